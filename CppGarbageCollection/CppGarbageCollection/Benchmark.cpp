@@ -0,0 +1,877 @@
+#include "gc_ptr.h"
+#include "gc_internal.h"
+#include <memory>
+#include <set>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace vczh;
+
+//////////////////////////////////////////////////////////////////
+// Benchmark [options] [case...]
+//
+// Every case runs once with gc_ptr and once with std::shared_ptr, and
+// some once more with a baseline, each in a child process, so the peak
+// RSS belongs to that run only. The shared_ptr runs break cycles and
+// unlink long lists by hand, as a program without a collector has to
+// do. mark ms and sweep ms are the time all collections of a gc_ptr run
+// spent in each phase.
+//
+// sizes allocates short-lived objects of 8 to 1000 bytes, the shared_ptr
+// run of it measures malloc. The arena rows of alloc and sizes take the
+// same slots from the arena and free them in batches, without a handle,
+// logs or collections. contention runs root copies and field
+// assignments on --threads mutators that share their targets. mark
+// forces collections of a live tree of 300k nodes, to compare the pauses
+// of --mark-threads. edges gives 2 and then 8 edges to every object of a
+// type without GC_POINTERS, and prints the memory per edge with the edge
+// maps in every handle and the time to mark an edge. Its multiset row
+// keeps the same edges in the two multisets of the old gc_handle. pool
+// allocates arrays of items, an item costs one gc_array slot instead of
+// one object. phases keeps a live set that switches between a small and
+// a 100 times larger one, to compare fixed thresholds with --growth.
+// requests and heaps run the same per-request graphs on --threads
+// workers, heaps puts each worker's graphs in its own gc_heap and
+// discards it after every request.
+//
+// --step=MB --max=MB --nursery=KB --mark-threads=N --finalizers=N
+// --incremental=N --growth=R --cpu-budget=F --candidates=N --background
+// --concurrent --counting
+//		gc_options of every gc_ptr run
+// --threads=N	mutators of the multithreaded cases
+// --trace=PATH	records the gc_ptr run of the last case for Replay
+// --scale=X	multiplies the work of every case
+//////////////////////////////////////////////////////////////////
+
+struct benchmark_config
+{
+	gc_options				options;
+	int						threads = 4;
+	double					scale = 1;
+};
+
+benchmark_config			config;
+
+size_t scaled(size_t n)
+{
+	return max((size_t)1, (size_t)(n * config.scale));
+}
+
+//////////////////////////////////////////////////////////////////
+// Pointer policies
+//////////////////////////////////////////////////////////////////
+
+class gc_node : ENABLE_GC
+{
+	GC_POINTERS(next)
+public:
+	gc_ptr<gc_node>			next;
+	size_t					value = 0;
+};
+
+class gc_tree : ENABLE_GC
+{
+	GC_POINTERS(children)
+public:
+	gc_ptr<gc_tree>			children[8];
+};
+
+// does not list its gc_ptr members, so its edges are kept in gc_edge_map
+class gc_fan : ENABLE_GC
+{
+public:
+	gc_ptr<gc_fan>			children[8];
+};
+
+// an object of N bytes besides its vtable and record
+template<size_t N>
+class gc_blob : ENABLE_GC
+{
+public:
+	char					data[N];
+};
+
+struct gc_item
+{
+	GC_POINTERS(next)
+	gc_ptr<gc_node>			next;
+	size_t					value = 0;
+};
+
+struct gc_policy
+{
+	template<typename T>
+	using ptr = gc_ptr<T>;
+	typedef gc_node			node;
+	typedef gc_tree			tree;
+	typedef gc_fan			fan;
+	typedef gc_ptr<gc_array<gc_item>>	pool;
+	template<size_t N>
+	using blob = gc_blob<N>;
+
+	static const char* name() { return "gc_ptr"; }
+
+	template<typename T>
+	static gc_ptr<T> make() { return make_gc<T>(); }
+
+	static pool make_pool(size_t count) { return make_gc_array<gc_item>(count); }
+
+	// the collector takes back cycles and long lists by itself
+	static void break_cycle(gc_ptr<gc_node>&) {}
+
+	static void collect() { gc_force_collect(); }
+
+	// a handle of a type without GC_POINTERS keeps its edges in these maps, tables that they spill to come from malloc
+	static size_t edge_map_bytes() { return sizeof(gc_edge_map<gc_handle*>) + sizeof(gc_edge_map<void**>); }
+
+	static double mark_ms() { return gc_get_stats().mark_ms; }
+};
+
+struct rc_node
+{
+	shared_ptr<rc_node>		next;
+	size_t					value = 0;
+};
+
+struct rc_tree
+{
+	shared_ptr<rc_tree>		children[8];
+};
+
+template<size_t N>
+struct rc_blob
+{
+	char					data[N];
+};
+
+struct rc_item
+{
+	shared_ptr<rc_node>		next;
+	size_t					value = 0;
+};
+
+struct rc_policy
+{
+	template<typename T>
+	using ptr = shared_ptr<T>;
+	typedef rc_node			node;
+	typedef rc_tree			tree;
+	typedef rc_tree			fan;
+	typedef shared_ptr<vector<rc_item>>	pool;
+	template<size_t N>
+	using blob = rc_blob<N>;
+
+	static const char* name() { return "shared_ptr"; }
+
+	template<typename T>
+	static shared_ptr<T> make() { return make_shared<T>(); }
+
+	static pool make_pool(size_t count) { return make_shared<vector<rc_item>>(count); }
+
+	static void break_cycle(shared_ptr<rc_node>& node) { node->next.reset(); }
+
+	static void collect() {}
+
+	static size_t edge_map_bytes() { return 0; }
+
+	static double mark_ms() { return 0; }
+};
+
+//////////////////////////////////////////////////////////////////
+// Cases, each returns the number of operations it performs
+//////////////////////////////////////////////////////////////////
+
+volatile size_t				benchmark_sink = 0;
+string						benchmark_note;		// printed under the row of the case
+
+// bytes that malloc has given out, the arena maps its pages without malloc
+size_t malloc_bytes()
+{
+	return mallinfo2().uordblks;
+}
+
+template<typename P>
+size_t bench_alloc()
+{
+	size_t n = scaled(2000000);
+	size_t sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		auto node = P::template make<typename P::node>();
+		node->value = i;
+		sum += node->value;
+	}
+	benchmark_sink = sum;
+	return n;
+}
+
+// short-lived objects of several size classes, the shared_ptr run is the malloc path
+template<typename P>
+size_t bench_sizes()
+{
+	size_t n = scaled(500000);
+	size_t sum = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		auto a = P::template make<typename P::template blob<8>>();
+		auto b = P::template make<typename P::template blob<48>>();
+		auto c = P::template make<typename P::template blob<200>>();
+		auto d = P::template make<typename P::template blob<1000>>();
+		a->data[0] = b->data[0] = c->data[0] = d->data[0] = (char)i;
+		sum += a->data[0] + d->data[0];
+	}
+	benchmark_sink = sum;
+	return n * 4;
+}
+
+// the slots that make_gc takes from the arena, without a handle, logs or collections, freed in batches like a sweep does
+class arena_baseline
+{
+private:
+	vector<void*>			garbages;
+public:
+	arena_baseline()
+	{
+		gc_arena_start();
+	}
+
+	~arena_baseline()
+	{
+		gc_arena_free(garbages.data(), garbages.size());
+		gc_arena_stop();
+	}
+
+	// returns the bytes of an object of <size> bytes, which is not constructed
+	char* make(size_t size)
+	{
+		void* memory = gc_arena_alloc(gc_handle_size + size);
+		if (garbages.size() == 1024)
+		{
+			gc_arena_free(garbages.data(), garbages.size());
+			garbages.clear();
+		}
+		garbages.push_back(memory);
+		return (char*)memory + gc_handle_size;
+	}
+};
+
+size_t bench_alloc_arena()
+{
+	size_t n = scaled(2000000);
+	size_t sum = 0;
+	arena_baseline arena;
+	for (size_t i = 0; i < n; i++)
+	{
+		auto node = arena.make(sizeof(gc_node));
+		node[0] = (char)i;
+		sum += node[0];
+	}
+	benchmark_sink = sum;
+	return n;
+}
+
+size_t bench_sizes_arena()
+{
+	size_t n = scaled(500000);
+	size_t sum = 0;
+	arena_baseline arena;
+	for (size_t i = 0; i < n; i++)
+	{
+		auto a = arena.make(sizeof(gc_blob<8>));
+		auto b = arena.make(sizeof(gc_blob<48>));
+		auto c = arena.make(sizeof(gc_blob<200>));
+		auto d = arena.make(sizeof(gc_blob<1000>));
+		a[0] = b[0] = c[0] = d[0] = (char)i;
+		sum += a[0] + d[0];
+	}
+	benchmark_sink = sum;
+	return n * 4;
+}
+
+template<typename P>
+size_t bench_assign()
+{
+	const size_t slot_count = 1024;
+	size_t n = scaled(20000000);
+	vector<typename P::template ptr<typename P::node>> slots;
+	for (size_t i = 0; i < slot_count; i++)
+	{
+		slots.push_back(P::template make<typename P::node>());
+	}
+	for (size_t i = 0; i < n; i++)
+	{
+		slots[(i * 7) % slot_count] = slots[(i * 13 + 1) % slot_count];
+	}
+	return n;
+}
+
+// every mutator copies the same shared pointers into its own slots and fields, so the counts of the shared targets are contended
+template<typename P>
+size_t bench_contention()
+{
+	const size_t slot_count = 1024;
+	size_t n = scaled(20000000) / config.threads;
+	vector<typename P::template ptr<typename P::node>> shared;
+	for (size_t i = 0; i < 64; i++)
+	{
+		shared.push_back(P::template make<typename P::node>());
+	}
+
+	vector<thread> mutators;
+	for (int t = 0; t < config.threads; t++)
+	{
+		mutators.push_back(thread([&, t]()
+		{
+			vector<typename P::template ptr<typename P::node>> slots(slot_count), owned;
+			for (size_t i = 0; i < slot_count; i++)
+			{
+				owned.push_back(P::template make<typename P::node>());
+			}
+			for (size_t i = 0; i < n; i++)
+			{
+				// a root copy and a field assignment
+				auto& slot = slots[(i * 7 + t) % slot_count];
+				slot = shared[(i * 13) % shared.size()];
+				owned[(i * 5 + 1) % slot_count]->next = slot;
+			}
+		}));
+	}
+	for (auto& mutator : mutators)
+	{
+		mutator.join();
+	}
+	return n * config.threads * 2;
+}
+
+template<typename P>
+size_t bench_cycles()
+{
+	size_t n = scaled(500000);
+	for (size_t i = 0; i < n; i++)
+	{
+		auto x = P::template make<typename P::node>();
+		auto y = P::template make<typename P::node>();
+		auto z = P::template make<typename P::node>();
+		x->next = y;
+		y->next = z;
+		z->next = x;
+		P::break_cycle(z);
+	}
+	return n;
+}
+
+template<typename P>
+size_t bench_list()
+{
+	size_t length = scaled(200000);
+	size_t rounds = 5;
+	size_t sum = 0;
+	for (size_t r = 0; r < rounds; r++)
+	{
+		typename P::template ptr<typename P::node> head;
+		for (size_t i = 0; i < length; i++)
+		{
+			auto node = P::template make<typename P::node>();
+			node->value = i;
+			node->next = head;
+			head = node;
+		}
+		for (auto node = head.get(); node; node = node->next.get())
+		{
+			sum += node->value;
+		}
+
+		// unlinks one node at a time, so that shared_ptr does not destroy the list recursively
+		while (head)
+		{
+			head = std::move(head->next);
+		}
+	}
+	benchmark_sink = sum;
+	return length * rounds;
+}
+
+template<typename P>
+typename P::template ptr<typename P::tree> build_tree(int depth, size_t& count)
+{
+	auto tree = P::template make<typename P::tree>();
+	count++;
+	if (depth > 0)
+	{
+		for (auto& child : tree->children)
+		{
+			child = build_tree<P>(depth - 1, count);
+		}
+	}
+	return tree;
+}
+
+template<typename P>
+size_t bench_fanout()
+{
+	size_t rounds = scaled(5);
+	size_t count = 0;
+	for (size_t r = 0; r < rounds; r++)
+	{
+		// 8^0 + ... + 8^6 nodes
+		build_tree<P>(6, count);
+	}
+	return count;
+}
+
+// a large live tree is collected again and again, every pause marks all of it and sweeps as many garbages
+template<typename P>
+size_t bench_mark()
+{
+	size_t rounds = scaled(10);
+	size_t count = 0;
+	auto live = build_tree<P>(6, count);
+	for (size_t r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			P::template make<typename P::node>();
+		}
+		P::collect();
+	}
+	return count * rounds;
+}
+
+// every node gets 2 edges, which stay inline, then 8 edges, which spill to a table
+// the memory per edge counts the edge maps in every handle and the tables that they spill to
+template<typename P>
+size_t bench_edges()
+{
+	size_t count = scaled(100000);
+	size_t rounds = 5;
+	vector<typename P::template ptr<typename P::fan>> nodes;
+	for (size_t i = 0; i < count; i++)
+	{
+		nodes.push_back(P::template make<typename P::fan>());
+	}
+	P::collect();
+
+	size_t edges = 0;
+	char note[256] = "";
+	for (size_t fanout : { 2, 8 })
+	{
+		size_t before = malloc_bytes();
+		for (size_t i = 0; i < count; i++)
+		{
+			for (size_t j = 0; j < fanout; j++)
+			{
+				nodes[i]->children[j] = nodes[(i * 7 + j * 13 + 1) % count];
+			}
+		}
+		// the first collection applies the logs, the others only traverse the edges
+		P::collect();
+		double bytes = (double)malloc_bytes() - (double)before + (double)(P::edge_map_bytes() * count);
+		double mark_ms = P::mark_ms();
+		for (size_t r = 1; r < rounds; r++)
+		{
+			P::collect();
+		}
+		mark_ms = P::mark_ms() - mark_ms;
+
+		size_t length = strlen(note);
+		snprintf(note + length, sizeof(note) - length, "%s%zu edges per node: %.1f bytes, %.1f ns to mark per edge", length ? ", " : "", fanout, bytes / (count * fanout), mark_ms * 1e6 / (count * fanout * (rounds - 1)));
+		edges += count * fanout * rounds;
+
+		for (auto& node : nodes)
+		{
+			for (auto& child : node->children) child.reset();
+		}
+		P::collect();
+	}
+	benchmark_note = note;
+	return edges;
+}
+
+// the same graph with the edges of the old gc_handle, a multiset of targets and a multiset of fields in every object
+struct multiset_fan
+{
+	multiset<multiset_fan*>	references;
+	multiset<void**>		handle_references;
+	multiset_fan*			children[8] = {};
+	bool					mark = false;
+};
+
+// marks from every node like the gc_ptr run, where every node is a root, and returns the number of edges that it follows
+size_t multiset_mark(vector<multiset_fan*>& nodes)
+{
+	for (auto node : nodes) node->mark = false;
+	size_t followed = 0;
+	vector<multiset_fan*> greys;
+	for (auto root : nodes)
+	{
+		if (root->mark) continue;
+		root->mark = true;
+		greys.push_back(root);
+		while (greys.size() > 0)
+		{
+			auto node = greys.back();
+			greys.pop_back();
+			for (auto child : node->references)
+			{
+				followed++;
+				if (!child->mark)
+				{
+					child->mark = true;
+					greys.push_back(child);
+				}
+			}
+		}
+	}
+	return followed;
+}
+
+size_t bench_edges_multiset()
+{
+	size_t count = scaled(100000);
+	size_t rounds = 5;
+	vector<multiset_fan*> nodes;
+	for (size_t i = 0; i < count; i++)
+	{
+		nodes.push_back(new multiset_fan);
+	}
+
+	size_t edges = 0;
+	size_t followed = 0;
+	char note[256] = "";
+	for (size_t fanout : { 2, 8 })
+	{
+		size_t before = malloc_bytes();
+		for (size_t i = 0; i < count; i++)
+		{
+			auto node = nodes[i];
+			for (size_t j = 0; j < fanout; j++)
+			{
+				auto child = nodes[(i * 7 + j * 13 + 1) % count];
+				node->children[j] = child;
+				node->references.insert(child);
+				node->handle_references.insert((void**)&node->children[j]);
+			}
+		}
+		double bytes = (double)malloc_bytes() - (double)before + (double)(2 * sizeof(multiset<void*>) * count);
+		auto start = chrono::steady_clock::now();
+		for (size_t r = 1; r < rounds; r++)
+		{
+			followed += multiset_mark(nodes);
+		}
+		double mark_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		size_t length = strlen(note);
+		snprintf(note + length, sizeof(note) - length, "%s%zu edges per node: %.1f bytes, %.1f ns to mark per edge", length ? ", " : "", fanout, bytes / (count * fanout), mark_ms * 1e6 / (count * fanout * (rounds - 1)));
+		edges += count * fanout * rounds;
+
+		for (auto node : nodes)
+		{
+			node->references.clear();
+			node->handle_references.clear();
+			for (auto& child : node->children) child = nullptr;
+		}
+	}
+	for (auto node : nodes)
+	{
+		delete node;
+	}
+	benchmark_sink = followed;
+	benchmark_note = note;
+	return edges;
+}
+
+template<typename P>
+size_t bench_pool()
+{
+	size_t count = scaled(100000);
+	size_t rounds = 20;
+	size_t sum = 0;
+	for (size_t r = 0; r < rounds; r++)
+	{
+		auto pool = P::make_pool(count);
+		for (auto& item : *pool)
+		{
+			item.value = r;
+			sum += item.value;
+		}
+	}
+	benchmark_sink = sum;
+	return count * rounds;
+}
+
+template<typename P>
+size_t bench_phases()
+{
+	size_t small = scaled(4000);
+	size_t churn = scaled(2000000);
+	size_t rounds = 4;
+	size_t ops = 0;
+	for (size_t r = 0; r < rounds; r++)
+	{
+		// the live set of the day is 100 times the one of the night
+		size_t live = r % 2 == 0 ? small : small * 100;
+		vector<typename P::template ptr<typename P::node>> nodes(live);
+		for (size_t i = 0; i < churn; i++)
+		{
+			auto node = P::template make<typename P::node>();
+			node->value = i;
+			nodes[(i * 7919) % live] = node;
+		}
+		ops += churn;
+	}
+	return ops;
+}
+
+// builds the graph of one request, every node points back to an earlier one
+template<typename F>
+size_t run_request(size_t request, F&& make)
+{
+	const size_t node_count = 256;
+	vector<decltype(make())> nodes;
+	nodes.reserve(node_count);
+	for (size_t i = 0; i < node_count; i++)
+	{
+		auto node = make();
+		node->value = request + i;
+		if (i > 0) node->next = nodes[(i * 31) % i];
+		nodes.push_back(node);
+	}
+
+	size_t sum = 0;
+	for (auto& node : nodes)
+	{
+		sum += node->next ? node->next->value : 0;
+	}
+	return sum;
+}
+
+template<typename P>
+size_t bench_requests()
+{
+	size_t n = scaled(40000) / config.threads;
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++)
+	{
+		workers.push_back(thread([=]()
+		{
+			size_t sum = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				sum += run_request(i, []() { return P::template make<typename P::node>(); });
+			}
+			benchmark_sink = sum;
+		}));
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	return n * config.threads * 256;
+}
+
+size_t bench_heaps()
+{
+	size_t n = scaled(40000) / config.threads;
+	vector<thread> workers;
+	for (int t = 0; t < config.threads; t++)
+	{
+		workers.push_back(thread([=]()
+		{
+			gc_heap heap;
+			size_t sum = 0;
+			for (size_t i = 0; i < n; i++)
+			{
+				sum += run_request(i, [&]() { return make_gc<gc_node>(heap); });
+				heap.discard();
+			}
+			benchmark_sink = sum;
+		}));
+	}
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+	return n * config.threads * 256;
+}
+
+template<typename P>
+size_t bench_threads()
+{
+	size_t n = scaled(400000) / config.threads;
+	vector<thread> mutators;
+	for (int t = 0; t < config.threads; t++)
+	{
+		mutators.push_back(thread([=]()
+		{
+			const size_t window = 64;
+			vector<typename P::template ptr<typename P::node>> keep(window);
+			for (size_t i = 0; i < n; i++)
+			{
+				auto x = P::template make<typename P::node>();
+				auto y = P::template make<typename P::node>();
+				x->next = y;
+				y->next = x;
+				keep[i % window] = keep[(i + 1) % window];
+				keep[(i + 2) % window] = x;
+				P::break_cycle(y);
+			}
+			for (auto& node : keep)
+			{
+				if (node) P::break_cycle(node);
+			}
+		}));
+	}
+	for (auto& mutator : mutators)
+	{
+		mutator.join();
+	}
+	return n * config.threads;
+}
+
+//////////////////////////////////////////////////////////////////
+// Runner
+//////////////////////////////////////////////////////////////////
+
+double peak_rss_mb()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+void run_case(const char* name, const char* pointer, size_t(*body)(), bool gc)
+{
+	if (gc) gc_start(config.options);
+	auto start = chrono::steady_clock::now();
+	size_t ops = body();
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	printf("%-10s %-12s %10.1f %12.1f", name, pointer, ms * 1e6 / ops, peak_rss_mb());
+	if (gc)
+	{
+		auto stats = gc_get_stats();
+		double max_ms = max(stats.major_pauses.max_ms, stats.minor_pauses.max_ms);
+		printf(" %10.0f %10.0f %10.0f %8zu %8zu %10.1f %10.1f\n", gc_pause_percentile_us(stats, 0.5), gc_pause_percentile_us(stats, 0.99), max_ms * 1000, stats.major_collections, stats.minor_collections, stats.mark_ms, stats.sweep_ms);
+		gc_stop();
+	}
+	else
+	{
+		printf(" %10s %10s %10s %8s %8s %10s %10s\n", "-", "-", "-", "-", "-", "-", "-");
+	}
+	if (benchmark_note.size() > 0)
+	{
+		printf("  %s\n", benchmark_note.c_str());
+	}
+	fflush(stdout);
+}
+
+// runs in a child process, so that the peak RSS and the heap start from scratch
+void run_isolated(const function<void()>& body)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		body();
+		_exit(0);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		printf("  the process failed with status %d\n", status);
+	}
+}
+
+struct benchmark_case
+{
+	const char*				name;
+	size_t(*gc_body)();
+	size_t(*rc_body)();
+	const char*				baseline_name;		// a third row that measures what gc_ptr replaced, or nullptr
+	size_t(*baseline_body)();
+};
+
+bool parse_option(const char* arg, const char* name, double& value)
+{
+	size_t length = strlen(name);
+	if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+	value = atof(arg + length + 1);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	benchmark_case cases[] =
+	{
+		{ "alloc", &bench_alloc<gc_policy>, &bench_alloc<rc_policy>, "arena", &bench_alloc_arena },
+		{ "sizes", &bench_sizes<gc_policy>, &bench_sizes<rc_policy>, "arena", &bench_sizes_arena },
+		{ "assign", &bench_assign<gc_policy>, &bench_assign<rc_policy> },
+		{ "contention", &bench_contention<gc_policy>, &bench_contention<rc_policy> },
+		{ "cycles", &bench_cycles<gc_policy>, &bench_cycles<rc_policy> },
+		{ "list", &bench_list<gc_policy>, &bench_list<rc_policy> },
+		{ "fanout", &bench_fanout<gc_policy>, &bench_fanout<rc_policy> },
+		{ "mark", &bench_mark<gc_policy>, &bench_mark<rc_policy> },
+		{ "edges", &bench_edges<gc_policy>, &bench_edges<rc_policy>, "multiset", &bench_edges_multiset },
+		{ "pool", &bench_pool<gc_policy>, &bench_pool<rc_policy> },
+		{ "phases", &bench_phases<gc_policy>, &bench_phases<rc_policy> },
+		{ "threads", &bench_threads<gc_policy>, &bench_threads<rc_policy> },
+		{ "requests", &bench_requests<gc_policy>, &bench_requests<rc_policy> },
+		{ "heaps", &bench_heaps, &bench_requests<rc_policy> },
+	};
+
+	config.options.step_size = 0x01000000;
+	config.options.max_size = 0x40000000;
+	vector<string> selected;
+	for (int i = 1; i < argc; i++)
+	{
+		double value = 0;
+		if (parse_option(argv[i], "--step", value)) config.options.step_size = (size_t)(value * 1024 * 1024);
+		else if (parse_option(argv[i], "--max", value)) config.options.max_size = (size_t)(value * 1024 * 1024);
+		else if (parse_option(argv[i], "--nursery", value)) config.options.nursery_size = (size_t)(value * 1024);
+		else if (parse_option(argv[i], "--mark-threads", value)) config.options.mark_threads = (int)value;
+		else if (parse_option(argv[i], "--finalizers", value)) config.options.finalizer_threads = (int)value;
+		else if (parse_option(argv[i], "--incremental", value)) config.options.incremental_budget = (size_t)value;
+		else if (parse_option(argv[i], "--growth", value)) config.options.growth_ratio = value;
+		else if (parse_option(argv[i], "--cpu-budget", value)) config.options.cpu_budget = value;
+		else if (parse_option(argv[i], "--candidates", value)) config.options.cycle_candidates = (size_t)value;
+		else if (parse_option(argv[i], "--threads", value)) config.threads = max(1, (int)value);
+		else if (parse_option(argv[i], "--scale", value)) config.scale = value;
+		else if (strcmp(argv[i], "--background") == 0) config.options.background = true;
+		else if (strcmp(argv[i], "--concurrent") == 0) config.options.concurrent = true;
+		else if (strcmp(argv[i], "--counting") == 0) config.options.reference_counting = true;
+		else if (strncmp(argv[i], "--trace=", 8) == 0) config.options.trace_path = argv[i] + 8;
+		else if (argv[i][0] == '-')
+		{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+		else selected.push_back(argv[i]);
+	}
+
+	printf("%-10s %-12s %10s %12s %10s %10s %10s %8s %8s %10s %10s\n", "case", "pointer", "ns/op", "peak RSS MB", "p50 us", "p99 us", "max us", "major", "minor", "mark ms", "sweep ms");
+	for (auto& c : cases)
+	{
+		if (selected.size() > 0 && find(selected.begin(), selected.end(), c.name) == selected.end()) continue;
+		run_isolated([&]() { run_case(c.name, gc_policy::name(), c.gc_body, true); });
+		run_isolated([&]() { run_case(c.name, rc_policy::name(), c.rc_body, false); });
+		if (c.baseline_body)
+		{
+			run_isolated([&]() { run_case(c.name, c.baseline_name, c.baseline_body, false); });
+		}
+	}
+	return 0;
+}
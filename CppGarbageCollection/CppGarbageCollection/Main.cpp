@@ -5,8 +5,12 @@
 #endif
 #include <assert.h>
 #include "gc_ptr.h"
+#include "gc_internal.h"
 #include <iostream>
 #include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
 
 using namespace std;
 using namespace vczh;
@@ -28,6 +32,8 @@ public:
 
 class B : ENABLE_GC, public virtual A
 {
+	GC_POINTERS(next)	// objects of this class are scanned without registering their fields
+	GC_RELOCATABLE		// objects of this class can be moved by gc_compact
 public:
 	B(int a) :A(a)
 	{
@@ -41,6 +47,7 @@ public:
 
 class C : ENABLE_GC, public virtual A
 {
+	GC_RELOCATABLE
 public:
 	C(int a) :A(a)
 	{
@@ -54,6 +61,8 @@ public:
 
 class D : ENABLE_GC, public B, public C
 {
+	GC_POINTERS(next)
+	GC_RELOCATABLE
 public:
 	D(int a) :A(a), B(a), C(a)
 	{
@@ -65,11 +74,55 @@ public:
 	}
 };
 
-int main()
+void test_edge_map()
+{
+	// edges spill from the inline entries to a table that grows, and the table is freed when the last edge is removed
+	gc_edge_map<void**> edges;
+	void* keys[100];
+	auto count_of = [&](void** key)
+	{
+		int count = 0;
+		for (auto& edge : edges)
+		{
+			if (edge.first == key) count += edge.second;
+		}
+		return count;
+	};
+
+	edges.add(&keys[0], 1);
+	edges.add(&keys[1], 2);
+	assert(edges.size() == 2 && count_of(&keys[1]) == 2);
+	for (int i = 0; i < 100; i++)
+	{
+		edges.add(&keys[i], i + 1);
+	}
+	assert(edges.size() == 100 && count_of(&keys[0]) == 2 && count_of(&keys[1]) == 4 && count_of(&keys[99]) == 100);
+
+	// removing an edge shifts others back, they must still be found
+	for (int i = 0; i < 100; i += 2)
+	{
+		edges.add(&keys[i], -count_of(&keys[i]));
+	}
+	assert(edges.size() == 50);
+	for (int i = 0; i < 100; i++)
+	{
+		assert(count_of(&keys[i]) == (i % 2 == 0 ? 0 : i == 1 ? 4 : i + 1));
+	}
+	for (int i = 1; i < 100; i += 2)
+	{
+		edges.add(&keys[i], -count_of(&keys[i]));
+	}
+	assert(edges.size() == 0 && !(edges.begin() != edges.end()));
+
+	// a removal may arrive before its insertion
+	edges.add(&keys[5], -1);
+	assert(edges.size() == 1 && count_of(&keys[5]) == -1);
+	edges.add(&keys[5], 1);
+	assert(edges.size() == 0);
+}
+
+void test_cycles()
 {
-	int step_size = 1024;		// collect whenever the increment of the memory exceeds <step_size> bytes
-	int max_size = 8192;		// collect whenever the total memory used exceeds <max_size> bytes
-	gc_start(step_size, max_size);
 	for (int i = 0; i < 65536; i++)
 	{
 		auto x = make_gc<B>(1);
@@ -82,12 +135,476 @@ int main()
 		assert(dynamic_gc_cast<C>(x->next));
 		assert(dynamic_gc_cast<D>(y->next));
 		assert(dynamic_gc_cast<B>(z->next));
+
+		gc_borrowed_ptr<A> it = x;
+		for (int j = 0; j < 3; j++)
+		{
+			it = it->next;
+		}
+		assert(it.get() == x.get());
+
+		gc_ptr<B> w = std::move(x);
+		swap(w, x);
+		assert(!w && x);
+
+		gc_ptr<A> t;
+		t = std::move(z->next);
+		z->next = std::move(t);
+		assert(!t && z->next.get() == x.get());
 		if (i % 1000 == 0)
 		{
 			cout << i << endl;
 		}
 	}
+}
+
+struct E
+{
+	GC_POINTERS(owner, link)
+	GC_RELOCATABLE
+	gc_ptr<gc_array<E>>	owner;
+	gc_ptr<A>			link;
+
+	~E()
+	{
+		assert(owner.operator->() == nullptr);
+	}
+};
+
+void test_arrays()
+{
+	for (int i = 0; i < 1000; i++)
+	{
+		auto links = make_gc_array<gc_ptr<A>>(16);
+		auto edges = make_gc_array<E>(16);
+		for (size_t j = 0; j < edges->size(); j++)
+		{
+			auto a = make_gc<B>(1);
+			(*links)[j] = a;
+			(*edges)[j].link = a;
+			(*edges)[j].owner = edges;
+		}
+		assert((*links)[15].get() == (*edges)[15].link.get());
+	}
+}
+
+void test_compact()
+{
+	// every node is followed by an object of the same type that is dropped later, so the list is left in half empty pages
+	auto head = make_gc<B>(0);
+	gc_ptr<A> tail = head;
+	gc_borrowed_ptr<A> middle;
+	vector<gc_ptr<A>> twins;
+	for (int i = 1; i <= 4096; i++)
+	{
+		gc_ptr<A> node;
+		if (i % 2 == 0)
+		{
+			node = make_gc<C>(i);
+			twins.push_back(make_gc<C>(i));
+		}
+		else
+		{
+			node = make_gc<D>(i);
+			twins.push_back(make_gc<D>(i));
+		}
+		tail->next = node;
+		tail = node;
+
+		if (i == 2048)
+		{
+			gc_pin(node);	// a borrowed pointer is still valid after gc_compact only if the object is pinned
+			middle = node;
+		}
+	}
+	tail.reset();
+	twins.clear();
+
+	auto moved = gc_get_stats().moved_objects;
+	gc_compact();
+	assert(gc_get_stats().moved_objects > moved);
+
+	int count = 0;
+	gc_borrowed_ptr<A> found;
+	for (gc_borrowed_ptr<A> it = head->next; it; it = it->next)
+	{
+		count++;
+		assert(count % 2 == 0 ? dynamic_cast<C*>(it.get()) != nullptr : dynamic_cast<D*>(it.get()) != nullptr);
+		if (count == 2048) found = it;
+	}
+	assert(count == 4096 && found.get() == middle.get());
+	gc_unpin(gc_ptr<A>(middle));
+}
+
+void test_weak()
+{
+	// a cache that does not keep its entries alive
+	auto kept = make_gc<C>(0);
+	vector<gc_weak_ptr<A>> cache;
+	cache.push_back(kept);
+	for (int i = 1; i < 1000; i++)
+	{
+		auto x = make_gc<B>(i);
+		x->next = make_gc<D>(i);
+		cache.push_back(x);
+
+		// an entry that is locked while collections are running keeps what it references
+		if (auto y = cache[i / 2].lock())
+		{
+			assert(i / 2 == 0 || dynamic_gc_cast<D>(y->next));
+		}
+	}
+
+	gc_force_collect();
+	assert(cache[0].lock().get() == kept.get());
+	for (size_t i = 1; i < cache.size(); i++)
+	{
+		assert(cache[i].expired() && !cache[i].lock());
+	}
+
+	gc_weak_ptr<A> copy = cache[0];
+	kept.reset();
+	gc_force_collect();
+	assert(copy.expired() && cache[0].expired());
+}
+
+void test_profile()
+{
+	auto head = make_gc<B>(0);
+	gc_ptr<A> target = head;
+	for (int i = 1; i <= 3; i++)
+	{
+		gc_ptr<A> node = make_gc<D>(i);
+		target->next = node;
+		target = node;
+	}
+
+	auto path = gc_retention_path(target);
+	assert(path.size() == 4);
+	assert(path.front().object == dynamic_cast<void*>(head.get()) && path.back().object == dynamic_cast<void*>(target.get()));
+
+	auto profile = gc_profile_heap();
+	size_t count = 0;
+	for (auto& type : profile.types)
+	{
+		if (type.type == "D" || type.type == "class D") count = type.count;
+	}
+	assert(count >= 3 && profile.bytes >= count * sizeof(D));
+
+	// only the argument keeps it alive
+	head->next.reset();
+	assert(gc_retention_path(target).size() == 0);
+}
+
+void test_heap()
+{
+	// a private heap is collected by itself, and objects in it are destroyed with it
+	gc_heap heap(4096);
+	gc_weak_ptr<A> weak;
+	{
+		auto head = make_gc<B>(heap, 0);
+		gc_ptr<A> tail = head;
+		for (int i = 1; i < 1000; i++)
+		{
+			auto x = make_gc<C>(heap, i);
+			x->next = make_gc<D>(heap, i);
+			x->next->next = x;
+			if (i % 10 == 0)
+			{
+				tail->next = x;
+				tail = x->next;
+			}
+		}
+		tail->next = head;
+		weak = tail;
+
+		auto items = make_gc_array<gc_ptr<A>>(heap, 16);
+		(*items)[0] = make_gc<B>(heap, 1);
+		heap.collect();
+		assert(heap.size() < 300 * sizeof(D) && !weak.expired());
+		assert(dynamic_gc_cast<B>((*items)[0]));
+
+		gc_borrowed_ptr<A> it = head;
+		for (int i = 0; i < 199; i++)
+		{
+			it = it->next;
+		}
+		assert(it.get() == head.get());
+	}
+	heap.collect();
+	assert(heap.size() == 0 && weak.expired());
+
+	for (int i = 0; i < 100; i++)
+	{
+		auto x = make_gc<C>(heap, i);
+		x->next = x;
+	}
+	{
+		// edges of an object that references many others are released without destructors
+		auto items = make_gc_array<gc_ptr<A>>(heap, 16);
+		for (auto& item : *items)
+		{
+			item = make_gc<C>(heap, 0);
+		}
+	}
+	heap.discard();
+	assert(heap.size() == 0);
+}
+
+void test_release()
+{
+	// memory of a burst is given back to the system when it is collected
+	{
+		auto items = make_gc_array<gc_ptr<A>>(100000);	// larger than a page
+		gc_ptr<A> head;
+		for (int i = 0; i < 20000; i++)
+		{
+			auto node = make_gc<D>(i);
+			node->next = head;
+			head = node;
+		}
+		(*items)[0] = head;
+	}
+	auto before = gc_get_stats();
+	gc_force_collect();
+	auto after = gc_get_stats();
+	assert(after.committed_bytes < before.committed_bytes && after.released_bytes > before.released_bytes);
+}
+
+void test_threads()
+{
+	// mutators copy shared gc_ptr, reassign their own and hand objects to each other while collections are running
+	vector<gc_ptr<A>> shared;
+	for (int i = 0; i < 64; i++)
+	{
+		auto x = make_gc<D>(i);
+		x->next = make_gc<B>(i);
+		shared.push_back(x);
+	}
+
+	mutex mailbox_lock;
+	vector<gc_ptr<A>> mailbox;
+	vector<thread> mutators;
+	vector<vector<gc_ptr<A>>> slots(4);
+	for (int t = 0; t < 4; t++)
+	{
+		mutators.push_back(thread([&, t]()
+		{
+			auto& local = slots[t];
+			local.resize(64);
+			for (int i = 0; i < 20000; i++)
+			{
+				auto x = make_gc<C>(i);
+				x->next = shared[(i * 7 + t) % shared.size()];
+				local[i % local.size()] = x;
+				local[(i * 13) % local.size()] = local[(i * 5 + 1) % local.size()];
+				if (i % 16 == 0)
+				{
+					lock_guard<mutex> guard(mailbox_lock);
+					mailbox.push_back(local[(i * 3) % local.size()]);
+					if (mailbox.size() > 8)
+					{
+						local[(i * 11) % local.size()] = std::move(mailbox.front());
+						mailbox.erase(mailbox.begin());
+					}
+				}
+			}
+		}));
+	}
+	for (auto& mutator : mutators)
+	{
+		mutator.join();
+	}
+
+	gc_force_collect();
+	for (auto& x : shared)
+	{
+		assert(dynamic_gc_cast<B>(x->next));
+	}
+	for (auto& local : slots)
+	{
+		for (auto& x : local)
+		{
+			assert(!x || (dynamic_gc_cast<C>(x) && dynamic_gc_cast<D>(x->next) && dynamic_gc_cast<B>(x->next->next)));
+		}
+	}
+	for (auto& x : mailbox)
+	{
+		assert(dynamic_gc_cast<C>(x) && dynamic_gc_cast<D>(x->next));
+	}
+}
+
+class F : ENABLE_GC
+{
+public:
+	static size_t	destroyed;
+
+	~F()
+	{
+		destroyed++;
+	}
+};
+
+size_t F::destroyed = 0;
+
+void test_counting()
+{
+	{
+		// a garbage is destroyed when the operation that flushed the log returns, not by the next flush
+		auto counted = gc_get_stats().counted_objects;
+		auto destroyed = F::destroyed;
+		while (gc_get_stats().counted_objects == counted)
+		{
+			make_gc<F>();
+		}
+		auto freed = gc_get_stats().counted_objects - counted;
+		gc_ptr<F> x = make_gc<F>();
+		assert(F::destroyed - destroyed >= freed);
+	}
+
+	// garbages are freed when they are no longer referenced, and cycles are found without marking the heap
+	auto before = gc_get_stats();
+	for (int i = 0; i < 10000; i++)
+	{
+		auto x = make_gc<C>(i);
+		x->next = make_gc<D>(i);
+		if (i % 2 == 0)
+		{
+			x->next->next = x;
+		}
+	}
+	auto after = gc_get_stats();
+	assert(after.counted_objects - before.counted_objects >= 9000);
+	assert(after.cycle_collections > before.cycle_collections && after.freed_objects > before.freed_objects);
+	assert(after.major_collections == before.major_collections);
+}
+
+void test_replay(const gc_options& options, const char* path, const gc_stats& recorded, bool threads)
+{
+	// the same operations drive the collector to the same collections
+	gc_start(options);
+	gc_replay_stats replayed;
+	bool succeeded = gc_replay(path, threads, replayed);
+	auto stats = gc_get_stats();
+	assert(succeeded && replayed.events > 0 && replayed.threads == 1 && replayed.diverged == 0);
+	assert(replayed.collections == recorded.major_collections + recorded.minor_collections);
+	assert(stats.major_collections == recorded.major_collections && stats.moved_objects == recorded.moved_objects);
+	gc_stop();
+}
+
+int main()
+{
+	int step_size = 1024;		// collect whenever the increment of the memory exceeds <step_size> bytes
+	int max_size = 8192;		// collect whenever the total memory used exceeds <max_size> bytes
+	test_edge_map();
+	gc_start(step_size, max_size);
+	test_cycles();
+	test_arrays();
+	test_compact();
+	test_weak();
+	test_profile();
+	test_heap();
+	test_release();
+	test_threads();
+	gc_stop();
+
+	gc_options options;
+	gc_stats stats;
+	options.step_size = step_size;
+	options.max_size = max_size;
+	options.mark_threads = 4;	// mark with the collecting thread and 3 workers
+	gc_start(options);
+	test_cycles();
+	test_threads();
+	gc_stop();
+
+	options.mark_threads = 1;
+	options.background = true;	// collect on a collector thread
+	gc_start(options);
+	test_cycles();
+	gc_stop();
+
+	options.concurrent = true;	// mark and sweep on the collector thread while this thread is running
+	gc_start(options);
+	test_cycles();
+	test_arrays();
+	test_compact();
+	test_weak();
+	test_heap();
+	test_threads();
+	gc_stop();
+
+	options.background = false;
+	options.concurrent = false;
+	options.incremental_budget = 256;	// collect in small steps when logs are flushed
+	options.finalizer_threads = 2;		// destroy garbages on other threads
+	gc_start(options);
+	test_cycles();
+	test_weak();
+	while (gc_collect_step(256) > 0);
+	gc_stop();
+
+	options.incremental_budget = 0;
+	options.finalizer_threads = 0;
+	options.growth_ratio = 1;		// collect whenever the heap doubles since the last collection
+	options.cpu_budget = 0.1;		// and let it grow faster while collections take more than 10% of the time
+	gc_start(options);
+	test_cycles();
+	stats = gc_get_stats();
+	assert(stats.paced_collections > 0 && stats.growth_ratio >= 1);
+	gc_stop();
+
+	options.growth_ratio = 0;
+	options.cpu_budget = 0;
+	options.step_size = max_size;
+	options.nursery_size = 512;	// collect young objects whenever 512 bytes are allocated
+	size_t minor_events = 0;
+	options.on_collection = [&](const gc_event& e)
+	{
+		if (e.trigger == gc_trigger::nursery) minor_events++;
+	};
+	gc_start(options);
+	test_cycles();
+	test_compact();
+	test_weak();
+	gc_force_collect();
+	stats = gc_get_stats();
+	assert(stats.minor_collections > 0 && stats.minor_collections == minor_events);
+	assert(stats.forced_collections > 0 && stats.freed_objects > 0);
+	gc_stop();
+
+	options.step_size = step_size * 8;
+	options.max_size = max_size * 128;
+	options.nursery_size = 0;
+	options.on_collection = nullptr;
+	options.reference_counting = true;	// free objects when nothing references them, and look for cycles among those that lose references
+	options.cycle_candidates = 256;
+	gc_start(options);
+	test_counting();
+	test_cycles();
+	test_arrays();
+	test_compact();
+	test_weak();
+	test_heap();
+	test_threads();
+	gc_stop();
+
+	options.step_size = step_size;
+	options.max_size = max_size;
+	options.reference_counting = false;
+	options.trace_path = "UnitTest.trace";	// record every gc_ptr operation to a file
+	gc_start(options);
+	test_cycles();
+	test_arrays();
+	test_compact();
+	test_weak();
+	test_heap();
+	stats = gc_get_stats();
 	gc_stop();
+	options.trace_path = "";
+	test_replay(options, "UnitTest.trace", stats, false);
+	test_replay(options, "UnitTest.trace", stats, true);
+	remove("UnitTest.trace");
 #ifdef _MSC_VER
 	_CrtDumpMemoryLeaks();
 #endif
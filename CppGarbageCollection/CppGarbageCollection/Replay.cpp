@@ -0,0 +1,148 @@
+#include "gc_ptr.h"
+#include <vector>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace vczh;
+
+//////////////////////////////////////////////////////////////////
+// Replay [options] trace...
+//
+// Drives the collector with traces written with gc_options::trace_path,
+// for example by Benchmark --trace=PATH, so that a change to the
+// collector is measured against the same operations every time. Every
+// trace is replayed in a child process, so the peak RSS belongs to that
+// replay only. The replay allocates objects of the recorded sizes whose
+// destructors do nothing, so ns/op is the cost of the collector and of
+// the gc_ptr operations alone.
+//
+// --step=MB --max=MB --nursery=KB --mark-threads=N --finalizers=N
+// --incremental=N --growth=R --cpu-budget=F --candidates=N --background
+// --concurrent --counting
+//		gc_options of every replay
+// --threads	replays every recorded thread on a thread of its own, in the recorded order
+//////////////////////////////////////////////////////////////////
+
+struct replay_config
+{
+	gc_options				options;
+	bool					threads = false;
+};
+
+replay_config				config;
+
+double peak_rss_mb()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss / 1024.0;
+}
+
+// returns the exit code of the child process
+int replay_isolated(const char* path)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		gc_start(config.options);
+		gc_replay_stats replayed;
+		auto start = chrono::steady_clock::now();
+		bool succeeded = gc_replay(path, config.threads, replayed);
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		auto stats = gc_get_stats();
+		gc_stop();
+		if (!succeeded)
+		{
+			printf("%s is not a complete trace\n", path);
+			fflush(stdout);
+			_exit(1);
+		}
+
+		double max_ms = max(stats.major_pauses.max_ms, stats.minor_pauses.max_ms);
+		printf("%-24s %8zu %10zu %10.1f %12.1f %10.0f %10.0f %10.0f %8zu %8zu %8zu %8zu\n",
+			path,
+			replayed.threads,
+			replayed.events,
+			ms * 1e6 / max((size_t)1, replayed.events),
+			peak_rss_mb(),
+			gc_pause_percentile_us(stats, 0.5),
+			gc_pause_percentile_us(stats, 0.99),
+			max_ms * 1000,
+			stats.major_collections,
+			stats.minor_collections,
+			replayed.collections,
+			replayed.diverged
+			);
+		fflush(stdout);
+		_exit(0);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status))
+	{
+		printf("  the process failed with status %d\n", status);
+		return 1;
+	}
+	return WEXITSTATUS(status);
+}
+
+bool parse_option(const char* arg, const char* name, double& value)
+{
+	size_t length = strlen(name);
+	if (strncmp(arg, name, length) != 0 || arg[length] != '=') return false;
+	value = atof(arg + length + 1);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	config.options.step_size = 0x01000000;
+	config.options.max_size = 0x40000000;
+	vector<string> traces;
+	for (int i = 1; i < argc; i++)
+	{
+		double value = 0;
+		if (parse_option(argv[i], "--step", value)) config.options.step_size = (size_t)(value * 1024 * 1024);
+		else if (parse_option(argv[i], "--max", value)) config.options.max_size = (size_t)(value * 1024 * 1024);
+		else if (parse_option(argv[i], "--nursery", value)) config.options.nursery_size = (size_t)(value * 1024);
+		else if (parse_option(argv[i], "--mark-threads", value)) config.options.mark_threads = (int)value;
+		else if (parse_option(argv[i], "--finalizers", value)) config.options.finalizer_threads = (int)value;
+		else if (parse_option(argv[i], "--incremental", value)) config.options.incremental_budget = (size_t)value;
+		else if (parse_option(argv[i], "--growth", value)) config.options.growth_ratio = value;
+		else if (parse_option(argv[i], "--cpu-budget", value)) config.options.cpu_budget = value;
+		else if (parse_option(argv[i], "--candidates", value)) config.options.cycle_candidates = (size_t)value;
+		else if (strcmp(argv[i], "--background") == 0) config.options.background = true;
+		else if (strcmp(argv[i], "--concurrent") == 0) config.options.concurrent = true;
+		else if (strcmp(argv[i], "--counting") == 0) config.options.reference_counting = true;
+		else if (strcmp(argv[i], "--threads") == 0) config.threads = true;
+		else if (argv[i][0] == '-')
+		{
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+		else traces.push_back(argv[i]);
+	}
+	if (traces.size() == 0)
+	{
+		fprintf(stderr, "no trace to replay\n");
+		return 1;
+	}
+
+	int result = 0;
+	printf("%-24s %8s %10s %10s %12s %10s %10s %10s %8s %8s %8s %8s\n", "trace", "threads", "records", "ns/op", "peak RSS MB", "p50 us", "p99 us", "max us", "major", "minor", "traced", "diverged");
+	for (auto& trace : traces)
+	{
+		if (replay_isolated(trace.c_str()) != 0) result = 1;
+	}
+	return result;
+}
@@ -0,0 +1,803 @@
+#include "gc_arena.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace vczh
+{
+	//////////////////////////////////////////////////////////////////
+	// size classes
+	//////////////////////////////////////////////////////////////////
+
+	const size_t gc_size_classes[gc_size_class_count] =
+	{
+		32, 48, 64, 80, 96, 112, 128,
+		160, 192, 224, 256,
+		320, 384, 448, 512,
+		640, 768, 896, 1024,
+		1280, 1536, 1792, 2048,
+		2560, 3072, 3584, 4096,
+		5120, 6144, 7168, 8192,
+	};
+
+	unsigned char						gc_size_class_table[gc_max_small_size / gc_slot_alignment + 1];
+
+	static_assert(gc_min_slot_size * gc_page_mark_words * 64 >= gc_page_size, "mark bits do not cover the smallest slots");
+
+	void gc_build_size_class_table()
+	{
+		int size_class = 0;
+		for (size_t i = 0; i <= gc_max_small_size / gc_slot_alignment; i++)
+		{
+			while (gc_size_classes[size_class] < i * gc_slot_alignment)
+			{
+				size_class++;
+			}
+			gc_size_class_table[i] = (unsigned char)size_class;
+		}
+	}
+
+	int gc_size_class_of(size_t size)
+	{
+		return gc_size_class_table[(size + gc_slot_alignment - 1) / gc_slot_alignment];
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// system memory
+	//
+	// Memory is mapped from the system directly instead of from malloc,
+	// so that it can be given back. Mapped memory is zero until it is
+	// written, and decommitted memory reads as zero again.
+	//////////////////////////////////////////////////////////////////
+
+	// maps gc_page_size aligned memory
+	void* gc_os_map(size_t size)
+	{
+#ifdef _MSC_VER
+		// the allocation granularity of Windows is 64KB
+		void* memory = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+		size_t padded = size + gc_page_size;
+		void* memory = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+		{
+			memory = nullptr;
+		}
+		else
+		{
+			// unmaps the unaligned head and the tail of the padding
+			uintptr_t start = (uintptr_t)memory;
+			uintptr_t aligned = (start + gc_page_size - 1) & ~(uintptr_t)(gc_page_size - 1);
+			if (aligned > start) munmap(memory, aligned - start);
+			if (aligned + size < start + padded) munmap((void*)(aligned + size), start + padded - aligned - size);
+			memory = (void*)aligned;
+		}
+#endif
+		if (!memory)
+		{
+			throw bad_alloc();
+		}
+		return memory;
+	}
+
+	void gc_os_unmap(void* memory, size_t size)
+	{
+#ifdef _MSC_VER
+		VirtualFree(memory, 0, MEM_RELEASE);
+#else
+		munmap(memory, size);
+#endif
+	}
+
+	// gives the memory back to the system but keeps the address range
+	void gc_os_decommit(void* memory, size_t size)
+	{
+#ifdef _MSC_VER
+		VirtualFree(memory, size, MEM_DECOMMIT);
+#else
+		madvise(memory, size, MADV_DONTNEED);
+#endif
+	}
+
+#ifdef _MSC_VER
+	void gc_os_commit(void* memory, size_t size)
+	{
+		if (!VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE))
+		{
+			throw bad_alloc();
+		}
+	}
+#else
+	// mmap commits a page when it is touched
+	void gc_os_commit(void*, size_t)
+	{
+	}
+#endif
+
+	//////////////////////////////////////////////////////////////////
+	// thread cache
+	//////////////////////////////////////////////////////////////////
+
+	struct gc_thread_cache_class
+	{
+		gc_page*						page = nullptr;
+		gc_free_slot*					free_list = nullptr;
+		char*							bump = nullptr;
+		char*							limit = nullptr;
+		intptr_t						allocated = 0;
+	};
+
+	struct gc_thread_cache
+	{
+		size_t							generation = 0;
+		gc_thread_cache_class			classes[gc_size_class_count];
+
+		~gc_thread_cache();
+	};
+
+	thread_local gc_thread_cache		gc_local_cache;
+
+	//////////////////////////////////////////////////////////////////
+	// pages
+	//
+	// Single pages are carved out of chunks that stay mapped until
+	// gc_arena_stop. An empty page is kept for reuse, and gc_arena_trim
+	// decommits those beyond gc_empty_page_limit. A page run for an
+	// object that does not fit in one page is mapped by itself, and is
+	// unmapped as soon as the object is freed.
+	//////////////////////////////////////////////////////////////////
+
+	const size_t						gc_empty_page_limit = 16;
+	const size_t						gc_chunk_size = 64 * gc_page_size;
+
+	atomic<gc_page_map_leaf*>			gc_page_map[gc_page_map_root_size];
+
+	mutex								gc_arena_lock;
+	atomic<size_t>						gc_arena_generation(0);
+	bool								gc_arena_running = false;
+	vector<gc_page*>					gc_arena_pages;
+	vector<gc_page*>					gc_empty_pages;			// committed, they are zeroed again when they are reused
+	vector<gc_page*>					gc_decommitted_pages;
+	vector<void*>						gc_arena_chunks;
+	char*								gc_chunk_bump = nullptr;	// [bump, limit) of the last chunk has never been used
+	char*								gc_chunk_limit = nullptr;
+	size_t								gc_committed_bytes = 0;	// pages that are used or kept empty
+	size_t								gc_released_bytes = 0;	// given back to the system since gc_arena_start
+	gc_page*							gc_available_pages[gc_size_class_count] = {};
+	int									gc_arena_holds = 0;
+	vector<gc_page*>					gc_held_pages;
+
+	void gc_page_link_unsafe(gc_page* page)
+	{
+		auto& head = gc_available_pages[page->size_class];
+		page->available = true;
+		page->prev = nullptr;
+		page->next = head;
+		if (head) head->prev = page;
+		head = page;
+	}
+
+	void gc_page_unlink_unsafe(gc_page* page)
+	{
+		auto& head = gc_available_pages[page->size_class];
+		if (page->prev) page->prev->next = page->next;
+		if (page->next) page->next->prev = page->prev;
+		if (head == page) head = page->next;
+		page->available = false;
+		page->prev = nullptr;
+		page->next = nullptr;
+	}
+
+	void gc_page_map_set_unsafe(gc_page* page, gc_page* value)
+	{
+		uintptr_t first = (uintptr_t)page >> gc_page_bits;
+		for (uintptr_t index = first; index < first + page->page_count; index++)
+		{
+			auto& root = gc_page_map[index >> gc_page_map_leaf_bits];
+			auto leaf = root.load(memory_order_relaxed);
+			if (!leaf)
+			{
+				leaf = new gc_page_map_leaf;
+				for (auto& entry : leaf->pages)
+				{
+					entry.store(nullptr, memory_order_relaxed);
+				}
+				root.store(leaf, memory_order_release);
+			}
+			leaf->pages[index & (gc_page_map_leaf_size - 1)].store(value, memory_order_release);
+		}
+	}
+
+	gc_page* gc_page_create_unsafe(size_t page_count, gc_space* space = nullptr)
+	{
+		// slot owners read their state from never allocated slots when walking a page, so pages start zeroed
+		void* memory = nullptr;
+		if (page_count > 1)
+		{
+			memory = gc_os_map(page_count * gc_page_size);
+			gc_committed_bytes += page_count * gc_page_size;
+		}
+		else if (gc_empty_pages.size() > 0)
+		{
+			memory = gc_empty_pages.back();
+			gc_empty_pages.pop_back();
+			memset(memory, 0, gc_page_size);
+		}
+		else if (gc_decommitted_pages.size() > 0)
+		{
+			memory = gc_decommitted_pages.back();
+			gc_decommitted_pages.pop_back();
+			gc_os_commit(memory, gc_page_size);
+			gc_committed_bytes += gc_page_size;
+		}
+		else
+		{
+			if (gc_chunk_bump == gc_chunk_limit)
+			{
+				gc_chunk_bump = (char*)gc_os_map(gc_chunk_size);
+				gc_chunk_limit = gc_chunk_bump + gc_chunk_size;
+				gc_arena_chunks.push_back(gc_chunk_bump);
+			}
+			memory = gc_chunk_bump;
+			gc_chunk_bump += gc_page_size;
+			gc_committed_bytes += gc_page_size;
+		}
+
+		auto page = new(memory)gc_page;
+		page->page_count = page_count;
+		page->slots = (char*)memory + (sizeof(gc_page) + gc_slot_alignment - 1) / gc_slot_alignment * gc_slot_alignment;
+		auto& pages = space ? space->pages : gc_arena_pages;
+		page->space = space;
+		page->index = pages.size();
+		pages.push_back(page);
+		gc_page_map_set_unsafe(page, page);
+		return page;
+	}
+
+	void gc_page_destroy_unsafe(gc_page* page)
+	{
+		auto& pages = page->space ? page->space->pages : gc_arena_pages;
+		auto last = pages.back();
+		last->index = page->index;
+		pages[page->index] = last;
+		pages.pop_back();
+		gc_page_map_set_unsafe(page, nullptr);
+
+		size_t page_count = page->page_count;
+		page->~gc_page();
+		if (page_count == 1)
+		{
+			gc_empty_pages.push_back(page);
+		}
+		else
+		{
+			gc_os_unmap(page, page_count * gc_page_size);
+			gc_committed_bytes -= page_count * gc_page_size;
+			gc_released_bytes += page_count * gc_page_size;
+		}
+	}
+
+	gc_page* gc_page_create_small_unsafe(int size_class, gc_space* space = nullptr)
+	{
+		auto page = gc_page_create_unsafe(1, space);
+		page->size_class = size_class;
+		page->slot_size = gc_size_classes[size_class];
+		page->slot_count = ((char*)page + gc_page_size - page->slots) / page->slot_size;
+		page->slot_reciprocal = (((uint64_t)1 << 32) + page->slot_size - 1) / page->slot_size;
+		page->bump = page->slots;
+		return page;
+	}
+
+	void gc_page_update_unsafe(gc_page* page)
+	{
+		// a page owned by a thread cache will be checked again when it is returned
+		if (page->owner) return;
+
+		if (page->live_count == 0)
+		{
+			if (gc_arena_holds == 0)
+			{
+				if (page->available) gc_page_unlink_unsafe(page);
+				gc_page_destroy_unsafe(page);
+				return;
+			}
+
+			// the collector is walking this page, it stays usable and is checked again by gc_arena_release
+			if (!page->held)
+			{
+				page->held = true;
+				gc_held_pages.push_back(page);
+			}
+		}
+
+		if (!page->available && !page->evacuating && (page->free_list || page->bump != gc_page_end(page)))
+		{
+			gc_page_link_unsafe(page);
+		}
+	}
+
+	void gc_cache_release_unsafe(gc_thread_cache&, gc_thread_cache_class& cc)
+	{
+		auto page = cc.page;
+		if (!page) return;
+
+		page->live_count += cc.allocated;
+		if (cc.free_list)
+		{
+			auto tail = cc.free_list;
+			while (tail->next) tail = tail->next;
+			tail->next = page->free_list;
+			page->free_list = cc.free_list;
+		}
+		page->bump = cc.bump;
+		page->owner = nullptr;
+		cc = gc_thread_cache_class();
+		gc_page_update_unsafe(page);
+	}
+
+	void gc_cache_acquire_unsafe(gc_thread_cache& cache, gc_thread_cache_class& cc, gc_page* page)
+	{
+		cc.page = page;
+		cc.free_list = page->free_list;
+		cc.bump = page->bump;
+		cc.limit = gc_page_end(page);
+		cc.allocated = 0;
+		page->free_list = nullptr;
+		page->bump = cc.limit;
+		page->owner = &cache;
+	}
+
+	gc_thread_cache::~gc_thread_cache()
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		if (generation != gc_arena_generation) return;
+
+		for (auto& cc : classes)
+		{
+			gc_cache_release_unsafe(*this, cc);
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// allocation
+	//////////////////////////////////////////////////////////////////
+
+	void* gc_arena_alloc_large(size_t size, gc_space* space = nullptr)
+	{
+		size_t header = (sizeof(gc_page) + gc_slot_alignment - 1) / gc_slot_alignment * gc_slot_alignment;
+		size_t page_count = (header + size + gc_page_size - 1) / gc_page_size;
+
+		lock_guard<mutex> guard(gc_arena_lock);
+		assert(gc_arena_running);
+		auto page = gc_page_create_unsafe(page_count, space);
+		page->slot_size = page_count * gc_page_size - header;
+		page->slot_count = 1;
+		page->slot_reciprocal = 0;		// the only slot is the first one
+		page->bump = gc_page_end(page);
+		page->live_count = 1;
+		return page->slots;
+	}
+
+	void* gc_arena_refill(gc_thread_cache& cache, int size_class)
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		assert(gc_arena_running);
+
+		if (cache.generation != gc_arena_generation)
+		{
+			// pages cached from a previous gc_start are already gone
+			for (auto& cc : cache.classes)
+			{
+				cc = gc_thread_cache_class();
+			}
+			cache.generation = gc_arena_generation;
+		}
+
+		auto& cc = cache.classes[size_class];
+		if (auto page = cc.page)
+		{
+			// slots that the collector freed while this page is owned
+			if (page->free_list)
+			{
+				page->live_count += cc.allocated;
+				cc.allocated = 0;
+				cc.free_list = page->free_list;
+				page->free_list = nullptr;
+			}
+			else
+			{
+				gc_cache_release_unsafe(cache, cc);
+			}
+		}
+
+		if (!cc.page)
+		{
+			auto page = gc_available_pages[size_class];
+			if (page)
+			{
+				gc_page_unlink_unsafe(page);
+			}
+			else
+			{
+				page = gc_page_create_small_unsafe(size_class);
+			}
+			gc_cache_acquire_unsafe(cache, cc, page);
+		}
+
+		void* memory = nullptr;
+		if (auto slot = cc.free_list)
+		{
+			cc.free_list = slot->next;
+			memory = slot;
+		}
+		else
+		{
+			memory = cc.bump;
+			cc.bump += cc.page->slot_size;
+		}
+		cc.allocated++;
+		return memory;
+	}
+
+	void* gc_arena_alloc(size_t size)
+	{
+		if (size > gc_max_small_size)
+		{
+			return gc_arena_alloc_large(size);
+		}
+
+		auto& cache = gc_local_cache;
+		int size_class = gc_size_class_of(size);
+		if (cache.generation == gc_arena_generation.load(memory_order_relaxed))
+		{
+			auto& cc = cache.classes[size_class];
+			if (auto slot = cc.free_list)
+			{
+				cc.free_list = slot->next;
+				cc.allocated++;
+				return slot;
+			}
+			if (cc.bump != cc.limit)
+			{
+				void* memory = cc.bump;
+				cc.bump += cc.page->slot_size;
+				cc.allocated++;
+				return memory;
+			}
+		}
+		return gc_arena_refill(cache, size_class);
+	}
+
+	bool gc_arena_has_local_slot(size_t size)
+	{
+		if (size > gc_max_small_size) return false;
+		auto& cache = gc_local_cache;
+		if (cache.generation != gc_arena_generation.load(memory_order_relaxed)) return false;
+		auto& cc = cache.classes[gc_size_class_of(size)];
+		return cc.free_list || cc.bump != cc.limit;
+	}
+
+	void gc_arena_free(void** memories, size_t count)
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		for (size_t i = 0; i < count; i++)
+		{
+			auto page = gc_page_of(memories[i]);
+			if (page->size_class != -1)
+			{
+				auto slot = reinterpret_cast<gc_free_slot*>(memories[i]);
+				slot->next = page->free_list;
+				page->free_list = slot;
+			}
+			page->live_count--;
+			gc_page_update_unsafe(page);
+		}
+	}
+
+	void gc_arena_hold(vector<gc_page*>& pages)
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		gc_arena_holds++;
+		pages = gc_arena_pages;
+	}
+
+	void gc_arena_release()
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		assert(gc_arena_holds > 0);
+		if (--gc_arena_holds > 0) return;
+
+		vector<gc_page*> pages;
+		pages.swap(gc_held_pages);
+		for (auto page : pages)
+		{
+			page->held = false;
+			gc_page_update_unsafe(page);
+		}
+	}
+
+	void gc_arena_trim()
+	{
+		vector<gc_page*> pages;
+		{
+			lock_guard<mutex> guard(gc_arena_lock);
+			if (gc_empty_pages.size() <= gc_empty_page_limit) return;
+			pages.assign(gc_empty_pages.begin() + gc_empty_page_limit, gc_empty_pages.end());
+			gc_empty_pages.resize(gc_empty_page_limit);
+		}
+
+		// no one else can see these pages, adjacent ones are decommitted in one call without the lock
+		sort(pages.begin(), pages.end());
+		for (size_t i = 0; i < pages.size();)
+		{
+			size_t j = i + 1;
+			while (j < pages.size() && (char*)pages[j] == (char*)pages[j - 1] + gc_page_size) j++;
+			gc_os_decommit(pages[i], (j - i) * gc_page_size);
+			i = j;
+		}
+
+		lock_guard<mutex> guard(gc_arena_lock);
+		gc_decommitted_pages.insert(gc_decommitted_pages.end(), pages.begin(), pages.end());
+		gc_committed_bytes -= pages.size() * gc_page_size;
+		gc_released_bytes += pages.size() * gc_page_size;
+	}
+
+	void gc_arena_memory(size_t& committed_bytes, size_t& released_bytes)
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		committed_bytes = gc_committed_bytes;
+		released_bytes = gc_released_bytes;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// evacuation
+	//
+	// Objects moved by the compactor are placed one after another in new
+	// pages, which are owned by a private cache until the compaction is
+	// done. Chosen pages are taken out of the available lists, so that
+	// neither the compactor nor other threads fill them again.
+	//////////////////////////////////////////////////////////////////
+
+	gc_thread_cache*					gc_evacuate_cache = nullptr;
+
+	void gc_arena_evacuate_begin(vector<gc_page*>& pages, double max_occupancy)
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		assert(!gc_evacuate_cache);
+		pages.clear();
+		for (auto page : gc_arena_pages)
+		{
+			if (page->size_class == -1 || page->owner || page->live_count == 0) continue;
+			if (page->live_count > max_occupancy * page->slot_count) continue;
+
+			if (page->available) gc_page_unlink_unsafe(page);
+			page->evacuating = true;
+			pages.push_back(page);
+		}
+		gc_evacuate_cache = new gc_thread_cache;
+		gc_evacuate_cache->generation = gc_arena_generation;
+	}
+
+	void* gc_arena_evacuate_alloc(size_t size)
+	{
+		assert(size <= gc_max_small_size);
+		int size_class = gc_size_class_of(size);
+		auto& cc = gc_evacuate_cache->classes[size_class];
+		if (cc.bump == cc.limit)
+		{
+			lock_guard<mutex> guard(gc_arena_lock);
+			gc_cache_release_unsafe(*gc_evacuate_cache, cc);
+			gc_cache_acquire_unsafe(*gc_evacuate_cache, cc, gc_page_create_small_unsafe(size_class));
+		}
+
+		void* memory = cc.bump;
+		cc.bump += cc.page->slot_size;
+		cc.allocated++;
+		return memory;
+	}
+
+	void gc_arena_evacuate_end(vector<gc_page*>& pages)
+	{
+		auto cache = gc_evacuate_cache;
+		gc_evacuate_cache = nullptr;
+		{
+			lock_guard<mutex> guard(gc_arena_lock);
+			for (auto& cc : cache->classes)
+			{
+				gc_cache_release_unsafe(*cache, cc);
+			}
+			for (auto page : pages)
+			{
+				page->evacuating = false;
+				gc_page_update_unsafe(page);
+			}
+		}
+		// every page is released, the destructor finds nothing to return
+		delete cache;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// spaces
+	//////////////////////////////////////////////////////////////////
+
+	void gc_space_link(gc_space* space, gc_page* page)
+	{
+		auto& head = space->available[page->size_class];
+		page->available = true;
+		page->prev = nullptr;
+		page->next = head;
+		if (head) head->prev = page;
+		head = page;
+	}
+
+	void gc_space_unlink(gc_space* space, gc_page* page)
+	{
+		auto& head = space->available[page->size_class];
+		if (page->prev) page->prev->next = page->next;
+		if (page->next) page->next->prev = page->prev;
+		if (head == page) head = page->next;
+		page->available = false;
+		page->prev = nullptr;
+		page->next = nullptr;
+	}
+
+	void* gc_space_alloc(gc_space* space, size_t size)
+	{
+		if (size > gc_max_small_size)
+		{
+			return gc_arena_alloc_large(size, space);
+		}
+
+		int size_class = gc_size_class_of(size);
+		auto page = space->available[size_class];
+		if (!page)
+		{
+			{
+				lock_guard<mutex> guard(gc_arena_lock);
+				assert(gc_arena_running);
+				page = gc_page_create_small_unsafe(size_class, space);
+			}
+			gc_space_link(space, page);
+		}
+
+		void* memory = nullptr;
+		if (auto slot = page->free_list)
+		{
+			page->free_list = slot->next;
+			memory = slot;
+		}
+		else
+		{
+			memory = page->bump;
+			page->bump += page->slot_size;
+		}
+		page->live_count++;
+		if (!page->free_list && page->bump == gc_page_end(page))
+		{
+			gc_space_unlink(space, page);
+		}
+		return memory;
+	}
+
+	void gc_space_free(gc_space* space, void* memory)
+	{
+		auto page = gc_page_of(memory);
+		assert(page->space == space);
+		page->live_count--;
+		if (page->size_class == -1)
+		{
+			lock_guard<mutex> guard(gc_arena_lock);
+			gc_page_destroy_unsafe(page);
+			return;
+		}
+
+		// empty pages are kept until gc_space_trim, so that a heap that allocates and frees in turn does not take the lock
+		auto slot = reinterpret_cast<gc_free_slot*>(memory);
+		slot->next = page->free_list;
+		page->free_list = slot;
+		if (!page->available)
+		{
+			gc_space_link(space, page);
+		}
+	}
+
+	void gc_space_trim(gc_space* space)
+	{
+		vector<gc_page*> empty_pages;
+		for (auto page : space->pages)
+		{
+			if (page->size_class != -1 && page->live_count == 0)
+			{
+				empty_pages.push_back(page);
+			}
+		}
+		if (empty_pages.size() == 0) return;
+
+		{
+			lock_guard<mutex> guard(gc_arena_lock);
+			for (auto page : empty_pages)
+			{
+				if (page->available) gc_space_unlink(space, page);
+				gc_page_destroy_unsafe(page);
+			}
+		}
+		gc_arena_trim();
+	}
+
+	void gc_space_clear(gc_space* space)
+	{
+		{
+			lock_guard<mutex> guard(gc_arena_lock);
+			while (space->pages.size() > 0)
+			{
+				gc_page_destroy_unsafe(space->pages.back());
+			}
+			for (auto& head : space->available)
+			{
+				head = nullptr;
+			}
+		}
+		gc_arena_trim();
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// arena
+	//////////////////////////////////////////////////////////////////
+
+	void gc_arena_start()
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		assert(!gc_arena_running);
+		gc_build_size_class_table();
+		gc_arena_running = true;
+		gc_arena_generation++;
+	}
+
+	void gc_arena_stop()
+	{
+		lock_guard<mutex> guard(gc_arena_lock);
+		assert(gc_arena_running);
+		gc_arena_running = false;
+		gc_arena_generation++;
+
+		for (auto page : gc_arena_pages)
+		{
+			gc_page_map_set_unsafe(page, nullptr);
+			if (page->page_count > 1)
+			{
+				gc_os_unmap(page, page->page_count * gc_page_size);
+			}
+		}
+		for (auto chunk : gc_arena_chunks)
+		{
+			gc_os_unmap(chunk, gc_chunk_size);
+		}
+		gc_arena_pages.clear();
+		gc_empty_pages.clear();
+		gc_decommitted_pages.clear();
+		gc_arena_chunks.clear();
+		gc_chunk_bump = nullptr;
+		gc_chunk_limit = nullptr;
+		gc_committed_bytes = 0;
+		gc_released_bytes = 0;
+		gc_held_pages.clear();
+		gc_arena_holds = 0;
+		for (auto& head : gc_available_pages)
+		{
+			head = nullptr;
+		}
+	}
+}
@@ -0,0 +1,165 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+namespace vczh
+{
+	//////////////////////////////////////////////////////////////////
+	// arena
+	//
+	// Objects are carved out of gc_page_size aligned pages. Each page
+	// serves a single size class, so allocating is popping a free slot
+	// or bumping a pointer inside a page owned by the current thread.
+	// Objects larger than gc_max_small_size get a page run of their own.
+	//////////////////////////////////////////////////////////////////
+
+	const size_t						gc_page_size = 64 * 1024;
+	const size_t						gc_slot_alignment = 16;
+	const size_t						gc_max_small_size = 8192;
+	const int							gc_size_class_count = 31;
+	const size_t						gc_min_slot_size = 32;
+	const size_t						gc_page_mark_words = gc_page_size / gc_min_slot_size / 64;
+
+	struct gc_thread_cache;
+	struct gc_space;
+
+	// a free slot keeps the free list link in its first pointer, the owner of the slot must not store state there
+	struct gc_free_slot
+	{
+		gc_free_slot*					next;
+	};
+
+	struct gc_page
+	{
+		gc_page*						prev = nullptr;				// link in the available list of the size class
+		gc_page*						next = nullptr;
+		bool							available = false;			// in the available list
+		bool							held = false;				// emptied while the collector is walking pages
+		bool							evacuating = false;			// objects are being moved out, nothing is allocated from it
+		size_t							index = 0;					// position in the page registry, or in the pages of its space
+		size_t							page_count = 1;				// how many gc_page_size units this page covers
+		int								size_class = -1;			// -1 for a large object page
+		size_t							slot_size = 0;
+		size_t							slot_count = 0;
+		uint64_t						slot_reciprocal = 0;		// 2^32 / slot_size rounded up, to find the index of a slot without dividing
+		char*							slots = nullptr;			// the first slot
+		char*							bump = nullptr;				// [bump, end of slots) has never been allocated
+		gc_free_slot*					free_list = nullptr;		// slots freed by the collector
+		intptr_t						live_count = 0;				// allocated slots, excluding what the owner has not reported yet
+		gc_thread_cache*				owner = nullptr;			// the thread that is allocating from this page
+		gc_space*						space = nullptr;			// the private space that the page belongs to
+		std::atomic<uint64_t>			marks[gc_page_mark_words];	// one bit per slot for the collector, zero when the page is created
+		std::atomic<uint64_t>			roots[gc_page_mark_words];	// one bit per slot for the collector, zero when the page is created
+	};
+
+	inline gc_page* gc_page_of(void* memory)
+	{
+		return reinterpret_cast<gc_page*>((uintptr_t)memory & ~(uintptr_t)(gc_page_size - 1));
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// page map
+	//
+	// A two level radix table from every gc_page_size unit of the address
+	// space to the page that covers it, so that any address can be
+	// resolved to its slot without searching. Lookups take no lock.
+	//////////////////////////////////////////////////////////////////
+
+	const int							gc_page_bits = 16;
+	const int							gc_page_map_leaf_bits = 16;
+	const size_t						gc_page_map_leaf_size = (size_t)1 << gc_page_map_leaf_bits;
+	const size_t						gc_page_map_root_size = sizeof(void*) == 8 ? (size_t)1 << 16 : (size_t)1 << (32 - gc_page_bits - gc_page_map_leaf_bits);
+
+	struct gc_page_map_leaf
+	{
+		std::atomic<gc_page*>			pages[gc_page_map_leaf_size];
+	};
+	extern std::atomic<gc_page_map_leaf*>	gc_page_map[gc_page_map_root_size];
+
+	inline gc_page* gc_page_map_find(void* memory)
+	{
+		uintptr_t index = (uintptr_t)memory >> gc_page_bits;
+		uintptr_t root = index >> gc_page_map_leaf_bits;
+		if (root >= gc_page_map_root_size) return nullptr;
+		auto leaf = gc_page_map[root].load(std::memory_order_acquire);
+		if (!leaf) return nullptr;
+		return leaf->pages[index & (gc_page_map_leaf_size - 1)].load(std::memory_order_acquire);
+	}
+
+	// an offset in a small page is below 2^16, so multiplying by the reciprocal gives the exact quotient
+	// a large page has one slot and a zero reciprocal
+	inline size_t gc_page_slot_index(gc_page* page, void* address)
+	{
+		return (size_t)(((uint64_t)((char*)address - page->slots) * page->slot_reciprocal) >> 32);
+	}
+
+	// returns the slot in the page that contains the address, or nullptr if it is in the page header
+	inline char* gc_page_slot_of(gc_page* page, void* memory)
+	{
+		if ((char*)memory < page->slots) return nullptr;
+		size_t index = gc_page_slot_index(page, memory);
+		if (index >= page->slot_count) return nullptr;
+		return page->slots + index * page->slot_size;
+	}
+
+	inline char* gc_page_end(gc_page* page)
+	{
+		return page->slots + page->slot_count * page->slot_size;
+	}
+
+	inline size_t gc_page_mark_word_count(gc_page* page)
+	{
+		return (page->slot_count + 63) / 64;
+	}
+
+	inline void gc_page_clear_marks(gc_page* page)
+	{
+		for (size_t i = 0; i < gc_page_mark_word_count(page); i++)
+		{
+			page->marks[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	extern void							gc_arena_start();
+	extern void							gc_arena_stop();
+	extern void*						gc_arena_alloc(size_t size);
+	// true if the cache of the current thread has a slot for <size> bytes, so that gc_arena_alloc does not take the arena lock
+	extern bool							gc_arena_has_local_slot(size_t size);
+	extern void							gc_arena_free(void** memories, size_t count);
+	// gives empty pages beyond a small reserve back to the system
+	extern void							gc_arena_trim();
+	extern void							gc_arena_memory(size_t& committed_bytes, size_t& released_bytes);
+	// pages in the snapshot are not released until gc_arena_release, so the collector can walk them without the arena lock
+	extern void							gc_arena_hold(std::vector<gc_page*>& pages);
+	extern void							gc_arena_release();
+
+	// chooses small pages that are not owned by any thread and not fuller than <max_occupancy>, they are not allocated from until gc_arena_evacuate_end
+	extern void							gc_arena_evacuate_begin(std::vector<gc_page*>& pages, double max_occupancy);
+	// allocates from new pages one after another, only the thread that called gc_arena_evacuate_begin can call it
+	extern void*						gc_arena_evacuate_alloc(size_t size);
+	extern void							gc_arena_evacuate_end(std::vector<gc_page*>& pages);
+
+	//////////////////////////////////////////////////////////////////
+	// spaces
+	//
+	// A space is a set of pages that only one thread uses. Its pages are
+	// in the page map but not in the page registry, so the collector and
+	// gc_arena_evacuate_begin never see them. Allocating and freeing in
+	// a space take no lock, only creating and destroying pages do.
+	//////////////////////////////////////////////////////////////////
+
+	struct gc_space
+	{
+		std::vector<gc_page*>			pages;
+		gc_page*						available[gc_size_class_count] = {};	// small pages that have free slots
+	};
+
+	extern void*						gc_space_alloc(gc_space* space, size_t size);
+	extern void							gc_space_free(gc_space* space, void* memory);
+	// destroys small pages that have no allocated slot
+	extern void							gc_space_trim(gc_space* space);
+	// destroys every page of the space
+	extern void							gc_space_clear(gc_space* space);
+}
@@ -0,0 +1,569 @@
+#pragma once
+#include "gc_ptr.h"
+#include "gc_arena.h"
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include <new>
+#include <thread>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace vczh
+{
+	//////////////////////////////////////////////////////////////////
+	// gc_spin_lock
+	//////////////////////////////////////////////////////////////////
+
+	class gc_spin_lock
+	{
+	private:
+		std::atomic<bool>				locked{ false };
+	public:
+		bool try_lock()
+		{
+			return !locked.exchange(true, std::memory_order_acquire);
+		}
+
+		void lock()
+		{
+			while (locked.exchange(true, std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		void unlock()
+		{
+			locked.store(false, std::memory_order_release);
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// gc_edge_map
+	//
+	// A counted set of pointers. The first few entries are stored in the
+	// map itself, more entries spill to an open addressing table with
+	// linear probing. Entries whose count drops to zero are removed, and
+	// the table is given back when the map becomes empty.
+	//////////////////////////////////////////////////////////////////
+
+	template<typename K>
+	struct gc_edge
+	{
+		K								first;			// nullptr if the slot in the table is empty
+		int								second;			// the count, it may go negative for a while
+	};
+
+	template<typename K>
+	class gc_edge_map
+	{
+	private:
+		static const uint32_t			inline_capacity = 2;
+		static const uint32_t			initial_capacity = 8;
+
+		uint32_t						count = 0;
+		uint32_t						capacity = 0;	// 0 if entries are stored inline
+		union
+		{
+			gc_edge<K>					inline_entries[inline_capacity];
+			gc_edge<K>*					table;
+		};
+
+		gc_edge<K>* entries()
+		{
+			return capacity ? table : inline_entries;
+		}
+
+		size_t hash(K key)const
+		{
+			size_t h = (size_t)key;
+			h ^= h >> 17;
+			h *= (size_t)0x9E3779B97F4A7C15ull;
+			h ^= h >> 29;
+			return h & (capacity - 1);
+		}
+
+		gc_edge<K>* find_in_table(K key)
+		{
+			for (size_t i = hash(key);; i = (i + 1) & (capacity - 1))
+			{
+				auto entry = &table[i];
+				if (entry->first == key || !entry->first) return entry;
+			}
+		}
+
+		void rehash(uint32_t new_capacity)
+		{
+			auto old_entries = entries();
+			auto old_limit = capacity ? capacity : count;
+			bool old_inline = capacity == 0;
+
+			auto new_table = new gc_edge<K>[new_capacity]();
+			gc_edge<K> moved[inline_capacity];
+			if (old_inline)
+			{
+				for (uint32_t i = 0; i < count; i++) moved[i] = old_entries[i];
+				old_entries = moved;
+			}
+			table = new_table;
+			capacity = new_capacity;
+			for (uint32_t i = 0; i < old_limit; i++)
+			{
+				if (old_entries[i].first)
+				{
+					*find_in_table(old_entries[i].first) = old_entries[i];
+				}
+			}
+			if (!old_inline) delete[] old_entries;
+		}
+
+		// backward shift deletion, so that probing never needs tombstones
+		void remove_from_table(gc_edge<K>* entry)
+		{
+			size_t hole = entry - table;
+			for (size_t i = (hole + 1) & (capacity - 1); table[i].first; i = (i + 1) & (capacity - 1))
+			{
+				size_t home = hash(table[i].first);
+				if (((i - home) & (capacity - 1)) >= ((i - hole) & (capacity - 1)))
+				{
+					table[hole] = table[i];
+					hole = i;
+				}
+			}
+			table[hole].first = nullptr;
+			table[hole].second = 0;
+		}
+
+	public:
+		class iterator
+		{
+		private:
+			gc_edge<K>*					current;
+			gc_edge<K>*					end;
+
+			void skip()
+			{
+				while (current != end && !current->first) current++;
+			}
+		public:
+			iterator(gc_edge<K>* _current, gc_edge<K>* _end) :current(_current), end(_end) { skip(); }
+			gc_edge<K>& operator*()const { return *current; }
+			gc_edge<K>* operator->()const { return current; }
+			iterator& operator++() { current++; skip(); return *this; }
+			bool operator!=(const iterator& it)const { return current != it.current; }
+		};
+
+		gc_edge_map()
+		{
+		}
+
+		gc_edge_map(const gc_edge_map&) = delete;
+		gc_edge_map& operator=(const gc_edge_map&) = delete;
+
+		~gc_edge_map()
+		{
+			if (capacity) delete[] table;
+		}
+
+		size_t size()const
+		{
+			return count;
+		}
+
+		iterator begin()
+		{
+			auto limit = capacity ? capacity : count;
+			return iterator(entries(), entries() + limit);
+		}
+
+		iterator end()
+		{
+			auto limit = capacity ? capacity : count;
+			return iterator(entries() + limit, entries() + limit);
+		}
+
+		// adds delta to the count of the key, and removes the key if the count becomes zero
+		void add(K key, int delta)
+		{
+			if (!capacity)
+			{
+				for (uint32_t i = 0; i < count; i++)
+				{
+					if (inline_entries[i].first == key)
+					{
+						if ((inline_entries[i].second += delta) == 0)
+						{
+							inline_entries[i] = inline_entries[--count];
+						}
+						return;
+					}
+				}
+				if (count < inline_capacity)
+				{
+					inline_entries[count].first = key;
+					inline_entries[count].second = delta;
+					count++;
+					return;
+				}
+				rehash(initial_capacity);
+			}
+
+			auto entry = find_in_table(key);
+			if (entry->first)
+			{
+				if ((entry->second += delta) == 0)
+				{
+					remove_from_table(entry);
+					if (--count == 0)
+					{
+						delete[] table;
+						capacity = 0;
+					}
+				}
+				return;
+			}
+
+			if ((count + 1) * 4 > capacity * 3)
+			{
+				rehash(capacity * 2);
+				entry = find_in_table(key);
+			}
+			entry->first = key;
+			entry->second = delta;
+			count++;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// gc_handle
+	//////////////////////////////////////////////////////////////////
+
+	enum class gc_handle_state : unsigned char
+	{
+		free,
+		allocated,
+		garbage,
+	};
+
+	// colors of trial deletion, every object is black outside of it
+	enum class gc_rc_color : unsigned char
+	{
+		black,
+		gray,						// counts of edges from objects reachable from candidates are subtracted
+		white,						// garbage unless it is reachable from a gray object that is still referenced
+		purple,						// its counts dropped but not to zero since the last trial deletion
+	};
+
+	struct gc_handle;
+
+	// shared by all gc_weak_ptr to an object, and by the object until it is swept
+	struct gc_weak_cell
+	{
+		gc_spin_lock					lock;			// a garbage is not destroyed while gc_weak_ptr::lock() is looking at it
+		std::atomic<gc_handle*>			target{ nullptr };	// cleared when the object is swept
+		std::atomic<size_t>				counter{ 0 };
+	};
+
+	// every object is stored in an arena slot right after its gc_handle
+	// edges are counted and may go negative for a while, because logs from different threads are applied in any order
+	struct gc_handle
+	{
+		gc_record						record;			// the arena reuses the first pointer when the slot is free
+		std::atomic<gc_handle_state>	state;			// read by a concurrent marker or sweeper while the owner allocates in the same page, not touched by the constructor
+		int								counter = 0;	// gc_ptr outside of the heap, change it with gc_add_roots
+		int								incoming = 0;	// gc_ptr in other objects, only counted with gc_options::reference_counting
+		unsigned char					minor_mark = 0;	// marked if it equals to the epoch of the running minor collection
+		unsigned char					age = 0;		// minor collections survived in the nursery
+		bool							old = false;	// promoted out of the nursery
+		bool							remembered = false;	// in the remembered set
+		bool							relocatable = false;	// gc_compact may move it
+		gc_rc_color						color = gc_rc_color::black;
+		unsigned short					pins = 0;		// gc_compact does not move it while it is pinned
+		size_t							nursery_index = (size_t)-1;
+		size_t							candidate_index = (size_t)-1;	// in the candidates of trial deletion
+		gc_pointer_map*					pointer_map = nullptr;	// fields are scanned with it instead of being registered
+		std::atomic<gc_weak_cell*>		weak{ nullptr };	// created by the first gc_weak_ptr
+		gc_edge_map<gc_handle*>			references;
+		gc_edge_map<void**>				handle_references;
+	};
+
+	const size_t						gc_handle_size = (sizeof(gc_handle) + gc_slot_alignment - 1) / gc_slot_alignment * gc_slot_alignment;
+
+	// constructs a handle in a slot that a sweeper may be reading, the state stays free until the owner publishes the handle
+	inline gc_handle* gc_handle_construct(void* memory)
+	{
+		reinterpret_cast<gc_handle*>(memory)->state.store(gc_handle_state::free, std::memory_order_relaxed);
+		return new(memory)gc_handle;
+	}
+
+	inline gc_handle* gc_find_unsafe(void* handle)
+	{
+		if (!handle) return nullptr;
+		auto result = reinterpret_cast<gc_handle*>((char*)handle - gc_handle_size);
+		return result->state == gc_handle_state::allocated ? result : nullptr;
+	}
+
+	// returns the object that contains the address, which could be a garbage whose destructor is running
+	inline gc_handle* gc_find_parent_unsafe(void** handle_reference)
+	{
+		auto page = gc_page_map_find(handle_reference);
+		if (!page) return nullptr;
+		auto slot = gc_page_slot_of(page, handle_reference);
+		if (!slot) return nullptr;
+
+		auto result = reinterpret_cast<gc_handle*>(slot);
+		if (result->state == gc_handle_state::free) return nullptr;
+		char* start = (char*)result->record.start;
+		if ((char*)handle_reference < start || (char*)handle_reference >= start + result->record.length) return nullptr;
+		return result;
+	}
+
+	// returns the allocated object that contains the address
+	inline gc_handle* gc_find_object_unsafe(void* address)
+	{
+		if (!address) return nullptr;
+		auto page = gc_page_map_find(address);
+		if (!page) return nullptr;
+		auto slot = gc_page_slot_of(page, address);
+		if (!slot) return nullptr;
+
+		auto result = reinterpret_cast<gc_handle*>(slot);
+		if (result->state != gc_handle_state::allocated) return nullptr;
+		char* start = (char*)result->record.start;
+		if ((char*)address < start || (char*)address >= start + result->record.length) return nullptr;
+		return result;
+	}
+
+	// calls f with the address of every gc_ptr in an object that has a pointer map
+	template<typename F>
+	void gc_for_each_field_unsafe(gc_handle* handle, F&& f)
+	{
+		auto pointer_map = handle->pointer_map;
+		char* item = (char*)handle->record.start + pointer_map->first;
+		size_t count = pointer_map->stride ? (handle->record.length - pointer_map->first) / pointer_map->stride : 1;
+		for (size_t i = 0; i < count; i++, item += pointer_map->stride)
+		{
+			for (auto offset : pointer_map->offsets)
+			{
+				f(reinterpret_cast<void**>(item + offset));
+			}
+		}
+	}
+
+	// calls f with every object that the handle references
+	// a gc_ptr stores a pointer to the object instead of its handle, which may point into the middle of it
+	template<typename F>
+	void gc_for_each_child_unsafe(gc_handle* handle, F&& f)
+	{
+		if (handle->pointer_map)
+		{
+			gc_for_each_field_unsafe(handle, [&](void** field)
+			{
+				if (auto child = gc_find_object_unsafe(unsafe_functions::gc_load_field(field)))
+				{
+					f(child);
+				}
+			});
+		}
+		else
+		{
+			for (auto& child : handle->references)
+			{
+				if (child.second > 0)
+				{
+					f(child.first);
+				}
+			}
+		}
+	}
+
+	// calls f with every object that the handle references as they are logged, and how many of its gc_ptr reference it
+	// with gc_options::reference_counting, edges of a precise object are logged as well
+	template<typename F>
+	void gc_for_each_edge_unsafe(gc_handle* handle, F&& f)
+	{
+		for (auto& child : handle->references)
+		{
+			if (child.second > 0)
+			{
+				f(child.first, child.second);
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// marker
+	//
+	// Mark bits are kept in the page of each object, so that clearing
+	// them is a short loop over every page, and sweeping finds unmarked
+	// slots a word at a time without reading live objects. Another bit
+	// per slot is set while the counter of the object is positive, so
+	// that roots are found without reading every object either.
+	//////////////////////////////////////////////////////////////////
+
+	inline void gc_prefetch(const void* address)
+	{
+#ifdef _MSC_VER
+		_mm_prefetch((const char*)address, _MM_HINT_T0);
+#else
+		__builtin_prefetch(address);
+#endif
+	}
+
+	inline int gc_lowest_bit(uint64_t word)
+	{
+#ifdef _MSC_VER
+		unsigned long index = 0;
+		_BitScanForward64(&index, word);
+		return (int)index;
+#else
+		return __builtin_ctzll(word);
+#endif
+	}
+
+	inline std::atomic<uint64_t>& gc_mark_word(gc_handle* handle, uint64_t& bit, bool roots = false)
+	{
+		auto page = gc_page_of(handle);
+		size_t index = gc_page_slot_index(page, handle);
+		bit = (uint64_t)1 << (index & 63);
+		std::atomic<uint64_t>* words = roots ? page->roots : page->marks;
+		return words[index >> 6];
+	}
+
+	inline void gc_add_roots(gc_handle* handle, int delta)
+	{
+		bool rooted = handle->counter > 0;
+		handle->counter += delta;
+		if (rooted != (handle->counter > 0))
+		{
+			uint64_t bit = 0;
+			auto& word = gc_mark_word(handle, bit, true);
+			if (rooted) word.fetch_and(~bit, std::memory_order_relaxed);
+			else word.fetch_or(bit, std::memory_order_relaxed);
+		}
+	}
+
+	inline bool gc_is_marked(gc_handle* handle)
+	{
+		uint64_t bit = 0;
+		return (gc_mark_word(handle, bit).load(std::memory_order_relaxed) & bit) != 0;
+	}
+
+	inline void gc_set_mark(gc_handle* handle)
+	{
+		uint64_t bit = 0;
+		gc_mark_word(handle, bit).fetch_or(bit, std::memory_order_relaxed);
+	}
+
+	// returns true if this call is the one that marks the handle
+	inline bool gc_try_mark(gc_handle* handle)
+	{
+		uint64_t bit = 0;
+		auto& word = gc_mark_word(handle, bit);
+		if (word.load(std::memory_order_relaxed) & bit) return false;
+		return (word.fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+	}
+
+	// calls f with every slot in the page whose bit is set, or clear if <inverted>
+	template<typename F>
+	void gc_for_each_slot_in(gc_page* page, std::atomic<uint64_t>* bits, bool inverted, F&& f)
+	{
+		size_t words = gc_page_mark_word_count(page);
+		for (size_t i = 0; i < words; i++)
+		{
+			uint64_t word = bits[i].load(std::memory_order_relaxed);
+			if (inverted) word = ~word;
+			if (i == words - 1 && page->slot_count % 64 != 0)
+			{
+				word &= ((uint64_t)1 << (page->slot_count % 64)) - 1;
+			}
+			char* first = page->slots + i * 64 * page->slot_size;
+			while (word)
+			{
+				char* slot = first + gc_lowest_bit(word) * page->slot_size;
+				word &= word - 1;
+				if (word)
+				{
+					gc_prefetch(first + gc_lowest_bit(word) * page->slot_size);
+				}
+				f(reinterpret_cast<gc_handle*>(slot));
+			}
+		}
+	}
+
+	// unmarked slots are free or hold garbages
+	template<typename F>
+	void gc_for_each_unmarked_slot(gc_page* page, F&& f)
+	{
+		gc_for_each_slot_in(page, page->marks, true, f);
+	}
+
+	template<typename F>
+	void gc_for_each_rooted_slot(gc_page* page, F&& f)
+	{
+		gc_for_each_slot_in(page, page->roots, false, f);
+	}
+
+	extern void							gc_marker_start(int threads);
+	extern void							gc_marker_stop();
+	extern void							gc_mark_unsafe(std::vector<gc_page*>& pages);
+
+	//////////////////////////////////////////////////////////////////
+	// trace
+	//
+	// With gc_options::trace_path every call that a gc_ptr, gc_weak_ptr or
+	// gc_heap makes into the collector is written to a file, in the order
+	// they take the trace lock. A record is an operation followed by its
+	// arguments as LEB128 numbers. An address is written as the distance
+	// from the previous address of the same kind, 0 for nullptr. A gc_ptr
+	// in an object is written as the object and the offset in it, other
+	// gc_ptr by their addresses. Calls from destructors of garbages are
+	// not written, a replay has already forgotten those objects.
+	//////////////////////////////////////////////////////////////////
+
+	enum class gc_trace_op : unsigned char
+	{
+		thread,						// index: following records are made by this thread
+		alloc,						// object, length, pointer map, relocatable, heap
+		learn,						// pointer map, first, stride, count, offsets...
+		attach,						// object, offset of enable_gc: the constructor is finished
+		ref_alloc,					// gc_ptr, target
+		ref_dealloc,				// gc_ptr
+		ref,						// gc_ptr, target
+		move_alloc,					// gc_ptr, source gc_ptr
+		move,						// gc_ptr, source gc_ptr
+		swap,						// gc_ptr, other gc_ptr
+		adopt,						// gc_ptr, object
+		pin,						// object
+		unpin,						// object
+		weak_alloc,					// object, cell
+		weak_retain,				// cell
+		weak_release,				// cell
+		weak_lock,					// gc_ptr, cell, 1 if the object is alive
+		heap_create,				// heap, step size
+		heap_destroy,				// heap
+		heap_collect,				// heap
+		heap_discard,				// heap
+		force_collect,
+		collect_step,				// budget
+		compact,					// max occupancy in millionths
+		relocate,					// object, new address: moved by gc_compact
+		collection,					// trigger, freed objects, freed bytes, live bytes: not replayed
+	};
+
+	extern bool							gc_tracing;
+	extern void							gc_trace_start(const std::string& path);
+	extern void							gc_trace_stop();
+	extern void							gc_trace_alloc(const gc_record& record, gc_pointer_map* pointer_map, bool relocatable, gc_heap* heap);
+	extern void							gc_trace_learn(gc_pointer_map* pointer_map);
+	extern void							gc_trace_attach(void* handle, enable_gc* e);
+	extern void							gc_trace_ref(gc_trace_op op, void** handle_reference, void** other_reference, void* handle, void* other_handle);
+	extern void							gc_trace_object(gc_trace_op op, void* handle, const void* cell);
+	extern void							gc_trace_weak(gc_trace_op op, gc_weak_cell* cell, void** handle_reference, bool locked);
+	extern void							gc_trace_heap(gc_trace_op op, gc_heap* heap, size_t step_size);
+	extern void							gc_trace_collect(gc_trace_op op, uint64_t value);
+	extern void							gc_trace_relocate_unsafe(void* handle, void* moved);
+	extern void							gc_trace_collection_unsafe(const gc_event& event);
+}
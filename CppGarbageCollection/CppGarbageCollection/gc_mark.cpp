@@ -0,0 +1,238 @@
+#include "gc_internal.h"
+#include <assert.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+namespace vczh
+{
+	//////////////////////////////////////////////////////////////////
+	// marker
+	//
+	// A collection is marked by the thread that runs it together with
+	// gc_options::mark_threads - 1 workers. Every participant scans a
+	// share of the pages for roots and traces from them with a private
+	// stack. When the stack grows it publishes half of it to a shared
+	// deque, which idle participants steal from. Edges are read without
+	// locks and the mark bits are atomic. In a stop-the-world collection
+	// nothing else changes the heap. With gc_options::concurrent,
+	// mutators keep writing fields while they are being scanned. Fields
+	// are then read with gc_load_field, and the log of every change
+	// keeps its old target alive. A child is prefetched when it is
+	// pushed, so that it is usually in the cache when it is popped.
+	//////////////////////////////////////////////////////////////////
+
+	const size_t						gc_mark_publish_size = 64;
+
+	struct gc_mark_queue
+	{
+		gc_spin_lock					lock;
+		deque<gc_handle*>				items;
+		atomic<size_t>					size{ 0 };
+		vector<gc_handle*>				stack;
+	};
+
+	struct gc_marker
+	{
+		int								threads = 1;
+		vector<thread>					workers;
+		vector<gc_mark_queue*>			queues;
+
+		mutex							lock;
+		condition_variable				job_started;
+		condition_variable				job_finished;
+		size_t							job = 0;
+		int								finished = 0;
+		bool							stopping = false;
+
+		vector<gc_page*>*				pages = nullptr;
+		atomic<int>						idle{ 0 };
+	};
+
+	gc_marker*							gc_marker_state = nullptr;
+
+	void gc_mark_publish(gc_mark_queue& queue)
+	{
+		if (queue.stack.size() < gc_mark_publish_size || queue.size.load(memory_order_relaxed) > 0) return;
+
+		size_t half = queue.stack.size() / 2;
+		lock_guard<gc_spin_lock> guard(queue.lock);
+		queue.items.insert(queue.items.end(), queue.stack.begin(), queue.stack.begin() + half);
+		queue.stack.erase(queue.stack.begin(), queue.stack.begin() + half);
+		queue.size.store(queue.items.size(), memory_order_relaxed);
+	}
+
+	// moves half of the shared deque of the victim to the private stack of the thief
+	bool gc_mark_steal(gc_mark_queue& thief, gc_mark_queue& victim)
+	{
+		if (victim.size.load(memory_order_relaxed) == 0) return false;
+
+		lock_guard<gc_spin_lock> guard(victim.lock);
+		size_t count = (victim.items.size() + 1) / 2;
+		if (count == 0) return false;
+		thief.stack.insert(thief.stack.end(), victim.items.begin(), victim.items.begin() + count);
+		victim.items.erase(victim.items.begin(), victim.items.begin() + count);
+		victim.size.store(victim.items.size(), memory_order_relaxed);
+		return true;
+	}
+
+	void gc_mark_trace(gc_mark_queue& queue)
+	{
+		while (queue.stack.size() > 0)
+		{
+			auto handle = queue.stack.back();
+			queue.stack.pop_back();
+			gc_for_each_child_unsafe(handle, [&](gc_handle* child)
+			{
+				if (gc_try_mark(child))
+				{
+					gc_prefetch(child);
+					queue.stack.push_back(child);
+				}
+			});
+			gc_mark_publish(queue);
+		}
+	}
+
+	void gc_mark_participate(gc_marker& marker, int id)
+	{
+		auto& queue = *marker.queues[id];
+		auto& pages = *marker.pages;
+
+		for (size_t i = id; i < pages.size(); i += marker.threads)
+		{
+			gc_for_each_rooted_slot(pages[i], [&](gc_handle* handle)
+			{
+				if (handle->state == gc_handle_state::allocated && gc_try_mark(handle))
+				{
+					queue.stack.push_back(handle);
+				}
+			});
+			gc_mark_publish(queue);
+		}
+
+		while (true)
+		{
+			gc_mark_trace(queue);
+
+			// take back what this participant published first, then steal from others
+			bool stolen = false;
+			for (int i = 0; i < marker.threads && !stolen; i++)
+			{
+				stolen = gc_mark_steal(queue, *marker.queues[(id + i) % marker.threads]);
+			}
+			if (stolen) continue;
+
+			// an idle participant never publishes, so when all of them are idle every deque is empty
+			marker.idle++;
+			while (true)
+			{
+				if (marker.idle == marker.threads) return;
+
+				bool found = false;
+				for (auto other : marker.queues)
+				{
+					if (other->size.load(memory_order_relaxed) > 0)
+					{
+						found = true;
+						break;
+					}
+				}
+				if (found)
+				{
+					marker.idle--;
+					break;
+				}
+				this_thread::yield();
+			}
+		}
+	}
+
+	void gc_mark_worker(gc_marker& marker, int id)
+	{
+		size_t job = 0;
+		while (true)
+		{
+			{
+				unique_lock<mutex> guard(marker.lock);
+				marker.job_started.wait(guard, [&]() { return marker.stopping || marker.job != job; });
+				if (marker.stopping) return;
+				job = marker.job;
+			}
+
+			gc_mark_participate(marker, id);
+
+			lock_guard<mutex> guard(marker.lock);
+			if (++marker.finished == marker.threads - 1)
+			{
+				marker.job_finished.notify_one();
+			}
+		}
+	}
+
+	void gc_marker_start(int threads)
+	{
+		assert(!gc_marker_state);
+		if (threads <= 0)
+		{
+			threads = max(1, (int)thread::hardware_concurrency());
+		}
+
+		gc_marker_state = new gc_marker;
+		gc_marker_state->threads = threads;
+		for (int i = 0; i < threads; i++)
+		{
+			gc_marker_state->queues.push_back(new gc_mark_queue);
+		}
+		for (int i = 1; i < threads; i++)
+		{
+			gc_marker_state->workers.push_back(thread(gc_mark_worker, ref(*gc_marker_state), i));
+		}
+	}
+
+	void gc_marker_stop()
+	{
+		assert(gc_marker_state);
+		{
+			lock_guard<mutex> guard(gc_marker_state->lock);
+			gc_marker_state->stopping = true;
+			gc_marker_state->job_started.notify_all();
+		}
+		for (auto& worker : gc_marker_state->workers)
+		{
+			worker.join();
+		}
+		for (auto queue : gc_marker_state->queues)
+		{
+			delete queue;
+		}
+		delete gc_marker_state;
+		gc_marker_state = nullptr;
+	}
+
+	void gc_mark_unsafe(vector<gc_page*>& pages)
+	{
+		auto& marker = *gc_marker_state;
+		marker.pages = &pages;
+		marker.idle = 0;
+
+		if (marker.threads > 1)
+		{
+			lock_guard<mutex> guard(marker.lock);
+			marker.finished = 0;
+			marker.job++;
+			marker.job_started.notify_all();
+		}
+
+		gc_mark_participate(marker, 0);
+
+		if (marker.threads > 1)
+		{
+			unique_lock<mutex> guard(marker.lock);
+			marker.job_finished.wait(guard, [&]() { return marker.finished == marker.threads - 1; });
+		}
+		marker.pages = nullptr;
+	}
+}
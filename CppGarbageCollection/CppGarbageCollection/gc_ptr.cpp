@@ -1,10 +1,27 @@
-#include "gc_ptr.h"
+#include "gc_internal.h"
 #include <assert.h>
+#include <string.h>
 #include <algorithm>
-#include <set>
+#include <unordered_set>
+#include <unordered_map>
+#include <new>
 #include <vector>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <typeinfo>
+#include <typeindex>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
 
 using namespace std;
 
@@ -31,299 +48,2660 @@ namespace vczh
 	// helper functions
 	//////////////////////////////////////////////////////////////////
 
-	struct gc_handle
+	mutex								gc_lock;
+	bool								gc_running = false;
+	size_t								gc_step_size = 0;
+	size_t								gc_max_size = 0;
+	size_t								gc_alloc_batch_size = 0;
+	size_t								gc_incremental_budget = 0;
+	bool								gc_concurrent = false;
+	size_t								gc_nursery_size = 0;
+	int									gc_promotion_age = 0;
+	size_t								gc_last_current_size = 0;
+	double								gc_growth_ratio = 0;
+	double								gc_cpu_budget = 0;
+	size_t								gc_current_size = 0;
+	size_t								gc_young_size = 0;
+	gc_stats							gc_statistics;
+	function<void(const gc_event&)>		gc_event_callback;
+	vector<gc_event>					gc_pending_events;		// reported after gc_lock is released
+	atomic<bool>						gc_events_pending{ false };
+	atomic<uint64_t>					gc_lock_wait_ns{ 0 };
+	atomic<uint64_t>					gc_finalize_ns{ 0 };
+
+	double gc_elapsed_ms(chrono::steady_clock::time_point start)
+	{
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	}
+
+	uint64_t gc_elapsed_ns(chrono::steady_clock::time_point start)
+	{
+		return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// pacer
+	//
+	// With gc_options::growth_ratio the next major collection starts
+	// when the heap grows by a ratio of what was alive after the last
+	// one. With gc_options::cpu_budget the ratio is raised when
+	// collections take more than their share of time: their cost grows
+	// with the live heap, and the time between them grows with the ratio,
+	// so the ratio that meets the budget is the current one scaled by the
+	// measured overhead over the budget.
+	//////////////////////////////////////////////////////////////////
+
+	const double						gc_max_ratio_scale = 16;	// the paced ratio never exceeds gc_options::growth_ratio by more than this
+
+	double								gc_paced_ratio = 0;
+	size_t								gc_next_trigger = 0;
+	double								gc_pacer_cost_ms = 0;		// collections since the last major collection
+	chrono::steady_clock::time_point	gc_pacer_start;
+
+	// requires gc_lock, sets the next trigger after a major collection
+	void gc_pace_unsafe()
+	{
+		if (gc_growth_ratio <= 0) return;
+
+		auto now = chrono::steady_clock::now();
+		double elapsed = chrono::duration<double, milli>(now - gc_pacer_start).count();
+		if (gc_cpu_budget > 0 && elapsed > 0)
+		{
+			double target = gc_paced_ratio * (gc_pacer_cost_ms / elapsed) / gc_cpu_budget;
+			gc_paced_ratio = min(max(gc_growth_ratio, (gc_paced_ratio + target) / 2), gc_growth_ratio * gc_max_ratio_scale);
+		}
+		gc_pacer_start = now;
+		gc_pacer_cost_ms = 0;
+
+		size_t live = gc_current_size;
+		size_t trigger = live + max(gc_step_size, (size_t)(live * gc_paced_ratio));
+		if (trigger > gc_max_size)
+		{
+			trigger = max(gc_max_size, live + gc_step_size);
+		}
+		gc_next_trigger = trigger;
+	}
+
+	// requires gc_lock
+	void gc_finish_collection_unsafe(const gc_event& event)
+	{
+		gc_pacer_cost_ms += event.mark_ms + event.sweep_ms;
+		gc_statistics.mark_ms += event.mark_ms;
+		gc_statistics.sweep_ms += event.sweep_ms;
+		gc_statistics.freed_objects += event.freed_objects;
+		gc_statistics.freed_bytes += event.freed_bytes;
+		gc_statistics.live_bytes = event.live_bytes;
+		if (gc_tracing)
+		{
+			gc_trace_collection_unsafe(event);
+		}
+		if (gc_event_callback)
+		{
+			gc_pending_events.push_back(event);
+			gc_events_pending.store(true, memory_order_release);
+		}
+	}
+
+	// calls gc_options::on_collection for collections that are finished, it should be called without gc_lock
+	void gc_report_events()
+	{
+		if (!gc_events_pending.load(memory_order_acquire)) return;
+
+		vector<gc_event> events;
+		function<void(const gc_event&)> callback;
+		{
+			lock_guard<mutex> guard(gc_lock);
+			events.swap(gc_pending_events);
+			gc_events_pending.store(false, memory_order_relaxed);
+			callback = gc_event_callback;
+		}
+		for (auto& event : events)
+		{
+			callback(event);
+		}
+	}
+
+	template<typename F>
+	void gc_for_each_handle_unsafe(F&& callback)
+	{
+		vector<gc_page*> pages;
+		gc_arena_hold(pages);
+		for (auto page : pages)
+		{
+			for (char* slot = page->slots; slot < gc_page_end(page); slot += page->slot_size)
+			{
+				auto handle = reinterpret_cast<gc_handle*>(slot);
+				if (handle->state == gc_handle_state::allocated)
+				{
+					callback(handle);
+				}
+			}
+		}
+		gc_arena_release();
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// generations
+	//
+	// With gc_options::nursery_size, new objects stay in the nursery
+	// until they survive gc_options::promotion_age minor collections.
+	// An old object that may reference a young one is remembered when
+	// the edge is applied from a log, so a minor collection only scans
+	// the nursery and the remembered set.
+	//////////////////////////////////////////////////////////////////
+
+	vector<gc_handle*>					gc_nursery;
+	unordered_set<gc_handle*>			gc_remembered;
+
+	void gc_nursery_add_unsafe(gc_handle* handle)
+	{
+		handle->nursery_index = gc_nursery.size();
+		gc_nursery.push_back(handle);
+	}
+
+	// removes a young object that is found by a major collection
+	void gc_nursery_remove_unsafe(gc_handle* handle)
+	{
+		if (handle->nursery_index != (size_t)-1)
+		{
+			auto last = gc_nursery.back();
+			last->nursery_index = handle->nursery_index;
+			gc_nursery[handle->nursery_index] = last;
+			gc_nursery.pop_back();
+			handle->nursery_index = (size_t)-1;
+		}
+		if (handle->remembered)
+		{
+			gc_remembered.erase(handle);
+			handle->remembered = false;
+		}
+	}
+
+	bool gc_has_young_child_unsafe(gc_handle* handle)
+	{
+		bool found = false;
+		gc_for_each_child_unsafe(handle, [&](gc_handle* child)
+		{
+			found = found || !child->old;
+		});
+		return found;
+	}
+
+	void gc_remember_unsafe(gc_handle* handle)
+	{
+		if (!handle->remembered)
+		{
+			handle->remembered = true;
+			gc_remembered.insert(handle);
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// weak references
+	//
+	// Weak pointers are never traced. When an object becomes a garbage,
+	// its weak cell is cleared and released in the same pass that finds
+	// it, so a gc_weak_ptr never sees an object that is being destroyed.
+	// Locking a weak pointer is logged like any other reference change,
+	// with every log locked when a cycle starts, finishes marking or runs
+	// a minor collection, so the phase and the marks cannot change while
+	// it decides whether the object is alive.
+	//////////////////////////////////////////////////////////////////
+
+	void gc_weak_unref(gc_weak_cell* cell)
+	{
+		if (cell->counter.fetch_sub(1, memory_order_acq_rel) == 1)
+		{
+			delete cell;
+		}
+	}
+
+	void gc_weak_clear_unsafe(gc_handle* handle)
+	{
+		if (auto cell = handle->weak.load(memory_order_relaxed))
+		{
+			handle->weak.store(nullptr, memory_order_relaxed);
+			{
+				lock_guard<gc_spin_lock> guard(cell->lock);
+				cell->target.store(nullptr, memory_order_release);
+			}
+			gc_weak_unref(cell);
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// reference counting
+	//
+	// With gc_options::reference_counting, an object also counts the
+	// gc_ptr in other objects of the shared heap that reference it. Counts
+	// change when logs are applied, while other threads may still hold
+	// changes that bring a count back, so an object whose counts drop to
+	// zero is only put aside. It is freed with every log locked, and then
+	// it releases its own edges, which may free its children.
+	//
+	// An object that loses a reference but is still referenced could be
+	// the last way into a garbage cycle. Such candidates are checked by
+	// trial deletion (Bacon and Rajan): edges among objects reachable from
+	// them are subtracted from their counts, objects whose counts are left
+	// at zero and that are not reachable from the others are garbage, and
+	// the counts of the survivors are restored.
+	//
+	// The gc_ptr operation that flushes a log writes its fields only after
+	// the flush, and it may be the one that drops the last reference to
+	// the object it reads. Garbages that a flush frees are kept in the log
+	// of the thread, and destroyed when it enters the log again for the
+	// next operation, so no other thread destroys them in the meantime.
+	//
+	// A pass costs the objects it visits, not the candidates it starts
+	// from. The next pass waits for at least as many candidates, so a long
+	// structure that keeps losing references is not walked again and again.
+	//////////////////////////////////////////////////////////////////
+
+	bool								gc_counting = false;
+	size_t								gc_cycle_candidates = 0;
+	size_t								gc_rc_candidate_limit = 0;	// candidates to wait for, <gc_cycle_candidates> or the objects the last pass visited
+	vector<gc_handle*>					gc_rc_zeros;		// objects whose counts dropped to zero, an object could be added more than once
+	vector<gc_handle*>					gc_rc_candidates;
+	vector<gc_handle*>					gc_rc_garbages;		// freed but not destroyed yet
+
+	bool gc_rc_is_zero(gc_handle* handle)
+	{
+		return handle->counter == 0 && handle->incoming == 0;
+	}
+
+	// requires gc_lock
+	void gc_rc_forget_unsafe(gc_handle* handle)
+	{
+		if (handle->candidate_index != (size_t)-1)
+		{
+			auto last = gc_rc_candidates.back();
+			last->candidate_index = handle->candidate_index;
+			gc_rc_candidates[handle->candidate_index] = last;
+			gc_rc_candidates.pop_back();
+			handle->candidate_index = (size_t)-1;
+		}
+		handle->color = gc_rc_color::black;
+	}
+
+	// requires gc_lock, called after counts of an object in the shared heap drop
+	void gc_rc_released_unsafe(gc_handle* handle)
+	{
+		if (gc_rc_is_zero(handle))
+		{
+			gc_rc_zeros.push_back(handle);
+		}
+		else if (handle->counter == 0)
+		{
+			// a cycle that is still referenced from outside of the heap is not garbage, the last root of it will make it a candidate
+			handle->color = gc_rc_color::purple;
+			if (handle->candidate_index == (size_t)-1)
+			{
+				handle->candidate_index = gc_rc_candidates.size();
+				gc_rc_candidates.push_back(handle);
+			}
+		}
+	}
+
+	// requires gc_lock, releases the edges of an object that becomes a garbage, except to objects that <alive> rejects
+	template<typename F>
+	void gc_rc_release_edges_unsafe(gc_handle* handle, F&& alive)
+	{
+		gc_for_each_edge_unsafe(handle, [&](gc_handle* child, int count)
+		{
+			if (child->state == gc_handle_state::allocated && alive(child))
+			{
+				child->incoming -= count;
+				gc_rc_released_unsafe(child);
+			}
+		});
+	}
+
+	// requires gc_lock and every log locked
+	void gc_rc_free_unsafe(gc_handle* handle)
+	{
+		handle->state = gc_handle_state::garbage;
+		gc_weak_clear_unsafe(handle);
+		gc_current_size -= handle->record.length;
+		gc_nursery_remove_unsafe(handle);
+		gc_rc_forget_unsafe(handle);
+		gc_rc_garbages.push_back(handle);
+	}
+
+	// requires gc_lock, hands over garbages that are freed but not destroyed
+	void gc_rc_take_garbages_unsafe(vector<gc_handle*>& garbages)
+	{
+		garbages.insert(garbages.end(), gc_rc_garbages.begin(), gc_rc_garbages.end());
+		gc_rc_garbages.clear();
+	}
+
+	// requires gc_lock, every log locked and no running marking, frees objects whose counts are zero
+	void gc_rc_reclaim_unsafe()
+	{
+		while (gc_rc_zeros.size() > 0)
+		{
+			auto handle = gc_rc_zeros.back();
+			gc_rc_zeros.pop_back();
+			if (handle->state != gc_handle_state::allocated || !gc_rc_is_zero(handle)) continue;
+
+			gc_rc_free_unsafe(handle);
+			gc_statistics.counted_objects++;
+			gc_statistics.counted_bytes += handle->record.length;
+			gc_rc_release_edges_unsafe(handle, [](gc_handle*) { return true; });
+		}
+	}
+
+	// requires gc_lock, every log locked and no running marking, frees garbage cycles that are reachable from candidates
+	void gc_rc_collect_cycles_unsafe()
+	{
+		gc_statistics.cycle_collections++;
+		gc_event event;
+		event.trigger = gc_trigger::candidates;
+		auto start = chrono::steady_clock::now();
+
+		vector<gc_handle*> roots;
+		vector<gc_handle*> stack;
+		size_t visited = 0;
+		auto gray = [&](gc_handle* handle)
+		{
+			if (handle->color != gc_rc_color::gray)
+			{
+				handle->color = gc_rc_color::gray;
+				stack.push_back(handle);
+				visited++;
+			}
+		};
+		for (auto handle : gc_rc_candidates)
+		{
+			handle->candidate_index = (size_t)-1;
+			if (handle->color == gc_rc_color::purple)
+			{
+				roots.push_back(handle);
+				gray(handle);
+			}
+		}
+		gc_rc_candidates.clear();
+		while (stack.size() > 0)
+		{
+			auto handle = stack.back();
+			stack.pop_back();
+			gc_for_each_edge_unsafe(handle, [&](gc_handle* child, int count)
+			{
+				child->incoming -= count;
+				gray(child);
+			});
+		}
+
+		// an object that is still referenced restores the counts of everything it reaches
+		vector<gc_handle*> blacks;
+		auto scan_black = [&](gc_handle* handle)
+		{
+			handle->color = gc_rc_color::black;
+			blacks.push_back(handle);
+			while (blacks.size() > 0)
+			{
+				auto black = blacks.back();
+				blacks.pop_back();
+				gc_for_each_edge_unsafe(black, [&](gc_handle* child, int count)
+				{
+					child->incoming += count;
+					if (child->color != gc_rc_color::black)
+					{
+						child->color = gc_rc_color::black;
+						blacks.push_back(child);
+					}
+				});
+			}
+		};
+		stack = roots;
+		while (stack.size() > 0)
+		{
+			auto handle = stack.back();
+			stack.pop_back();
+			if (handle->color != gc_rc_color::gray) continue;
+			if (!gc_rc_is_zero(handle))
+			{
+				scan_black(handle);
+			}
+			else
+			{
+				handle->color = gc_rc_color::white;
+				gc_for_each_edge_unsafe(handle, [&](gc_handle* child, int)
+				{
+					stack.push_back(child);
+				});
+			}
+		}
+		event.mark_ms = gc_elapsed_ms(start);
+		start = chrono::steady_clock::now();
+
+		// edges from white objects are not restored, they disappear with them
+		stack = roots;
+		while (stack.size() > 0)
+		{
+			auto handle = stack.back();
+			stack.pop_back();
+			if (handle->color != gc_rc_color::white) continue;
+
+			event.freed_objects++;
+			event.freed_bytes += handle->record.length;
+			gc_rc_free_unsafe(handle);
+			gc_for_each_edge_unsafe(handle, [&](gc_handle* child, int)
+			{
+				stack.push_back(child);
+			});
+		}
+		event.sweep_ms = gc_elapsed_ms(start);
+		event.live_bytes = gc_current_size;
+		gc_finish_collection_unsafe(event);
+
+		// marking is postponed as if it has just run
+		gc_last_current_size = gc_current_size;
+		gc_pace_unsafe();
+		gc_rc_candidate_limit = max(gc_cycle_candidates, visited);
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// collection cycle
+	//
+	// A cycle clears the mark bits with every log locked, then marks and
+	// sweeps the pages that exist at that moment. It either runs in one
+	// pause, or in steps while other threads keep going. In the latter case the heap is kept as it was at the
+	// beginning: a target that loses a reference is marked when the log
+	// entry is applied, and new objects are allocated marked. Marking is
+	// finished with every log locked again, which only traces what has
+	// been recorded since the last slice.
+	//////////////////////////////////////////////////////////////////
+
+	enum class gc_phase
+	{
+		idle,
+		marking,
+		sweeping,
+	};
+
+	struct gc_cycle
+	{
+		atomic<gc_phase>				phase{ gc_phase::idle };	// changed with gc_lock, gc_weak_lock reads it without
+		vector<gc_page*>				pages;				// held by the arena until the cycle is finished
+		size_t							root_cursor = 0;	// pages before it are scanned for roots
+		size_t							sweep_cursor = 0;	// pages before it are swept
+		size_t							root_slots = 0;		// slots that are not scanned for roots yet
+		size_t							sweep_slots = 0;	// slots that are not swept yet
+		vector<gc_handle*>				greys;
+		gc_event						event;
+	};
+
+	gc_cycle							gc_current_cycle;
+
+	void gc_grey_unsafe(gc_handle* handle)
+	{
+		if (gc_try_mark(handle))
+		{
+			gc_prefetch(handle);
+			gc_current_cycle.greys.push_back(handle);
+		}
+	}
+
+	// requires gc_lock and every log locked
+	void gc_cycle_begin_unsafe(gc_trigger trigger)
+	{
+		auto& cycle = gc_current_cycle;
+		assert(cycle.phase == gc_phase::idle);
+
+		gc_young_size = 0;
+		gc_statistics.major_collections++;
+		switch (trigger)
+		{
+		case gc_trigger::max:
+			gc_statistics.max_collections++;
+			break;
+		case gc_trigger::forced:
+			gc_statistics.forced_collections++;
+			break;
+		case gc_trigger::paced:
+			gc_statistics.paced_collections++;
+			break;
+		default:
+			gc_statistics.step_collections++;
+		}
+		cycle.event = gc_event();
+		cycle.event.trigger = trigger;
+		gc_arena_hold(cycle.pages);
+		cycle.phase.store(gc_phase::marking, memory_order_release);
+		cycle.root_cursor = 0;
+		cycle.sweep_cursor = 0;
+		cycle.root_slots = 0;
+		for (auto page : cycle.pages)
+		{
+			// new handles are allocated marked until the next cycle begins
+			gc_page_clear_marks(page);
+			cycle.root_slots += page->slot_count;
+		}
+		cycle.sweep_slots = cycle.root_slots;
+	}
+
+	// requires gc_lock, returns the work left in the running cycle
+	size_t gc_cycle_remaining_unsafe()
+	{
+		auto& cycle = gc_current_cycle;
+		if (cycle.phase == gc_phase::idle) return 0;
+		return cycle.greys.size() + cycle.root_slots + cycle.sweep_slots;
+	}
+
+	// requires gc_lock, consumes the budget and returns true if all roots are scanned and no grey object is left
+	bool gc_cycle_mark_unsafe(size_t& budget)
+	{
+		auto& cycle = gc_current_cycle;
+		auto start = chrono::steady_clock::now();
+		while (budget > 0)
+		{
+			if (cycle.greys.size() > 0)
+			{
+				auto handle = cycle.greys.back();
+				cycle.greys.pop_back();
+				gc_for_each_child_unsafe(handle, gc_grey_unsafe);
+				budget--;
+			}
+			else if (cycle.root_cursor < cycle.pages.size())
+			{
+				auto page = cycle.pages[cycle.root_cursor++];
+				gc_for_each_rooted_slot(page, [](gc_handle* handle)
+				{
+					if (handle->state == gc_handle_state::allocated)
+					{
+						gc_grey_unsafe(handle);
+					}
+				});
+				cycle.root_slots -= page->slot_count;
+				budget -= min(budget, page->slot_count);
+			}
+			else
+			{
+				break;
+			}
+		}
+		cycle.event.mark_ms += gc_elapsed_ms(start);
+		return cycle.greys.size() == 0 && cycle.root_cursor == cycle.pages.size();
+	}
+
+	// requires gc_lock and every log locked, releases edges from objects that the running cycle is going to sweep
+	void gc_rc_forget_unmarked_unsafe()
+	{
+		auto marked = [](gc_handle* handle)
+		{
+			return gc_is_marked(handle);
+		};
+		for (auto page : gc_current_cycle.pages)
+		{
+			gc_for_each_unmarked_slot(page, [&](gc_handle* handle)
+			{
+				if (handle->state == gc_handle_state::allocated)
+				{
+					gc_rc_forget_unsafe(handle);
+					gc_rc_release_edges_unsafe(handle, marked);
+				}
+			});
+		}
+		gc_rc_zeros.erase(remove_if(gc_rc_zeros.begin(), gc_rc_zeros.end(), [](gc_handle* handle)
+		{
+			return handle->state != gc_handle_state::allocated || !gc_is_marked(handle);
+		}), gc_rc_zeros.end());
+	}
+
+	// requires gc_lock and every log locked
+	void gc_cycle_remark_unsafe()
+	{
+		size_t budget = (size_t)-1;
+		gc_cycle_mark_unsafe(budget);
+		gc_current_cycle.phase.store(gc_phase::sweeping, memory_order_release);
+		if (gc_counting)
+		{
+			gc_rc_forget_unmarked_unsafe();
+		}
+	}
+
+	// requires gc_lock, consumes the budget and returns true if the cycle is finished
+	bool gc_cycle_sweep_unsafe(size_t& budget, vector<gc_handle*>& garbages)
+	{
+		auto& cycle = gc_current_cycle;
+		auto start = chrono::steady_clock::now();
+		while (budget > 0 && cycle.sweep_cursor < cycle.pages.size())
+		{
+			auto page = cycle.pages[cycle.sweep_cursor++];
+			gc_for_each_unmarked_slot(page, [&](gc_handle* handle)
+			{
+				// a slot may be allocated after its bit is read, and a new handle is marked before its state is set
+				if (handle->state == gc_handle_state::allocated && !gc_is_marked(handle))
+				{
+					// garbages are hidden from gc_find_unsafe until they are destroyed
+					handle->state = gc_handle_state::garbage;
+					gc_weak_clear_unsafe(handle);
+					gc_current_size -= handle->record.length;
+					cycle.event.freed_objects++;
+					cycle.event.freed_bytes += handle->record.length;
+					gc_nursery_remove_unsafe(handle);
+					garbages.push_back(handle);
+				}
+			});
+			cycle.sweep_slots -= page->slot_count;
+			budget -= min(budget, page->slot_count);
+		}
+		cycle.event.sweep_ms += gc_elapsed_ms(start);
+		if (cycle.sweep_cursor < cycle.pages.size()) return false;
+
+		// garbages keep their pages alive until they are destroyed
+		gc_last_current_size = gc_current_size;
+		gc_arena_release();
+		cycle.pages.clear();
+		cycle.phase.store(gc_phase::idle, memory_order_release);
+		cycle.event.live_bytes = gc_current_size;
+		gc_finish_collection_unsafe(cycle.event);
+		gc_pace_unsafe();
+		return true;
+	}
+
+	// requires gc_lock and every log locked, finishes the running cycle in this pause
+	void gc_cycle_finish_unsafe(vector<gc_handle*>& garbages)
+	{
+		if (gc_current_cycle.phase == gc_phase::marking)
+		{
+			gc_cycle_remark_unsafe();
+		}
+		if (gc_current_cycle.phase == gc_phase::sweeping)
+		{
+			size_t budget = (size_t)-1;
+			gc_cycle_sweep_unsafe(budget, garbages);
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// reference logs
+	//
+	// gc_ptr operations do not touch the heap. Each thread appends them to
+	// its own log, which is applied in a batch under gc_lock when it is
+	// full, and before every collection. A collection keeps every log
+	// locked until garbages are found, so no thread can record anything
+	// that the collector has not seen.
+	//////////////////////////////////////////////////////////////////
+
+	enum class gc_ref_op : unsigned char
+	{
+		ref,
+		alloc,
+		dealloc,
+	};
+
+	struct gc_ref_entry
+	{
+		gc_handle*						parent;				// nullptr if the gc_ptr is a root
+		void**							handle_reference;
+		gc_handle*						old_target;
+		gc_handle*						new_target;
+		gc_ref_op						op;
+	};
+
+	const size_t						gc_ref_log_capacity = 256;
+
+	struct gc_ref_log
+	{
+		gc_spin_lock					lock;
+		bool							registered = false;
+		size_t							count = 0;
+		size_t							allocated_size = 0;
+		vector<gc_handle*>				allocated;			// new objects for the nursery
+		vector<gc_handle*>				garbages;			// freed by reference counting in the last flush, destroyed when the operation that flushed returns
+		bool							destroying = false;
+		gc_ref_entry					entries[gc_ref_log_capacity];
+
+		~gc_ref_log();
+	};
+
+	thread_local gc_ref_log				gc_local_log;
+	vector<gc_ref_log*>					gc_ref_logs;
+
+	// changes the edges of the parent, or the counters of targets if the gc_ptr is a root
+	void gc_apply_edges_unsafe(const gc_ref_entry& entry)
+	{
+		if (auto parent = entry.parent)
+		{
+			// edges of a precise object are read from its fields
+			// reference counting still keeps them, because a field may change only after its log is applied
+			if (parent->pointer_map && !gc_counting) return;
+
+			if (!parent->pointer_map)
+			{
+				switch (entry.op)
+				{
+				case gc_ref_op::alloc:
+					parent->handle_references.add(entry.handle_reference, 1);
+					break;
+				case gc_ref_op::dealloc:
+					parent->handle_references.add(entry.handle_reference, -1);
+					break;
+				default:;
+				}
+			}
+			if (entry.old_target) parent->references.add(entry.old_target, -1);
+			if (entry.new_target) parent->references.add(entry.new_target, 1);
+		}
+		else
+		{
+			if (entry.old_target) gc_add_roots(entry.old_target, -1);
+			if (entry.new_target) gc_add_roots(entry.new_target, 1);
+		}
+	}
+
+	void gc_apply_unsafe(const gc_ref_entry& entry)
+	{
+		// the target may only be reachable from the heap at the beginning of the cycle
+		if (entry.old_target && gc_current_cycle.phase == gc_phase::marking)
+		{
+			gc_grey_unsafe(entry.old_target);
+		}
+
+		auto parent = entry.parent;
+		if (parent && entry.new_target && parent->old && !entry.new_target->old)
+		{
+			gc_remember_unsafe(parent);
+		}
+		gc_apply_edges_unsafe(entry);
+
+		if (gc_counting)
+		{
+			if (auto target = entry.new_target)
+			{
+				if (parent) target->incoming++;
+				if (target->color == gc_rc_color::purple) target->color = gc_rc_color::black;
+				if (gc_rc_is_zero(target)) gc_rc_zeros.push_back(target);	// edges are counted in any order, a count may reach zero from below
+			}
+			if (auto target = entry.old_target)
+			{
+				if (parent) target->incoming--;
+				gc_rc_released_unsafe(target);
+			}
+		}
+	}
+
+	// requires gc_lock and log.lock
+	void gc_drain_log_unsafe(gc_ref_log& log)
+	{
+		for (size_t i = 0; i < log.count; i++)
+		{
+			gc_apply_unsafe(log.entries[i]);
+		}
+		log.count = 0;
+		gc_current_size += log.allocated_size;
+		gc_young_size += log.allocated_size;
+		log.allocated_size = 0;
+		for (auto handle : log.allocated)
+		{
+			gc_nursery_add_unsafe(handle);
+		}
+		log.allocated.clear();
+	}
+
+	chrono::steady_clock::time_point	gc_pause_start;
+
+	// requires gc_lock, locks and applies every log
+	void gc_lock_logs_unsafe()
+	{
+		gc_pause_start = chrono::steady_clock::now();
+		for (auto log : gc_ref_logs)
+		{
+			log->lock.lock();
+			gc_drain_log_unsafe(*log);
+		}
+	}
+
+	void gc_unlock_logs_unsafe()
+	{
+		for (auto log : gc_ref_logs)
+		{
+			log->lock.unlock();
+		}
+	}
+
+	// unlocks every log and records how long other threads are stopped
+	void gc_unlock_logs_unsafe(gc_pause_stats& pauses)
+	{
+		gc_unlock_logs_unsafe();
+		double ms = gc_elapsed_ms(gc_pause_start);
+		pauses.count++;
+		pauses.total_ms += ms;
+		pauses.max_ms = max(pauses.max_ms, ms);
+
+		int bucket = 0;
+		while (bucket < gc_pause_histogram_size - 1 && ms * 1000 >= (double)(1 << bucket))
+		{
+			bucket++;
+		}
+		gc_statistics.pause_histogram[bucket]++;
+	}
+
+	gc_ref_log::~gc_ref_log()
+	{
+		if (!registered) return;
+
+		lock_guard<mutex> guard(gc_lock);
+		if (!registered) return;
+		{
+			lock_guard<gc_spin_lock> log_guard(lock);
+			gc_drain_log_unsafe(*this);
+		}
+		gc_rc_garbages.insert(gc_rc_garbages.end(), garbages.begin(), garbages.end());
+		gc_ref_logs.erase(find(gc_ref_logs.begin(), gc_ref_logs.end(), this));
+		registered = false;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// collector
+	//////////////////////////////////////////////////////////////////
+
+	void gc_destroy_disconnect_unsafe(gc_handle* handle)
+	{
+		if (handle->pointer_map)
+		{
+			gc_for_each_field_unsafe(handle, [](void** field)
+			{
+				*field = nullptr;
+			});
+			return;
+		}
+		for (auto& handle_reference : handle->handle_references)
+		{
+			if (handle_reference.second > 0)
+			{
+				*handle_reference.first = nullptr;
+			}
+		}
+	}
+
+	void gc_finalize(vector<gc_handle*>& garbages)
+	{
+		auto start = chrono::steady_clock::now();
+		for (auto handle : garbages)
+		{
+			gc_destroy_disconnect_unsafe(handle);
+		}
+
+		// destructors may allocate, so memory is returned to the arena only after all of them are done
+		vector<void*> memories;
+		memories.reserve(garbages.size());
+		for (auto handle : garbages)
+		{
+			handle->record.handle->~enable_gc();
+			memories.push_back(handle);
+			handle->state = gc_handle_state::free;
+			handle->~gc_handle();
+		}
+		gc_arena_free(memories.data(), memories.size());
+		gc_arena_trim();
+		gc_finalize_ns += gc_elapsed_ns(start);
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// finalizers
+	//
+	// With gc_options::finalizer_threads, garbages are not destroyed by
+	// the thread that sweeps them. They are queued in batches and a pool
+	// of threads runs their destructors and returns their memory.
+	//////////////////////////////////////////////////////////////////
+
+	const size_t						gc_finalize_batch_size = 256;
+
+	struct gc_finalizer
+	{
+		vector<thread>					workers;
+		mutex							lock;
+		condition_variable				queue_changed;
+		deque<vector<gc_handle*>>		batches;
+		size_t							running = 0;		// batches that are being destroyed
+		bool							stopping = false;
+	};
+
+	gc_finalizer*						gc_finalizer_state = nullptr;
+	thread_local bool					gc_finalizer_thread = false;
+
+	void gc_finalizer_worker(gc_finalizer& finalizer)
+	{
+		gc_finalizer_thread = true;
+		while (true)
+		{
+			vector<gc_handle*> garbages;
+			{
+				unique_lock<mutex> guard(finalizer.lock);
+				finalizer.queue_changed.wait(guard, [&]() { return finalizer.stopping || finalizer.batches.size() > 0; });
+				if (finalizer.batches.size() == 0) return;
+				garbages.swap(finalizer.batches.front());
+				finalizer.batches.pop_front();
+				finalizer.running++;
+			}
+
+			gc_finalize(garbages);
+
+			lock_guard<mutex> guard(finalizer.lock);
+			finalizer.running--;
+			finalizer.queue_changed.notify_all();
+		}
+	}
+
+	void gc_finalizer_start(int threads)
+	{
+		assert(!gc_finalizer_state);
+		gc_finalizer_state = new gc_finalizer;
+		for (int i = 0; i < threads; i++)
+		{
+			gc_finalizer_state->workers.push_back(thread(gc_finalizer_worker, ref(*gc_finalizer_state)));
+		}
+	}
+
+	// queued batches are destroyed before the threads exit
+	void gc_finalizer_stop()
+	{
+		if (!gc_finalizer_state) return;
+		{
+			lock_guard<mutex> guard(gc_finalizer_state->lock);
+			gc_finalizer_state->stopping = true;
+			gc_finalizer_state->queue_changed.notify_all();
+		}
+		for (auto& worker : gc_finalizer_state->workers)
+		{
+			worker.join();
+		}
+		delete gc_finalizer_state;
+		gc_finalizer_state = nullptr;
+	}
+
+	// waits until every queued batch is destroyed, unless it is called by a destructor on a finalizer thread
+	void gc_finalizer_wait()
+	{
+		if (!gc_finalizer_state || gc_finalizer_thread) return;
+		unique_lock<mutex> guard(gc_finalizer_state->lock);
+		gc_finalizer_state->queue_changed.wait(guard, [&]() { return gc_finalizer_state->batches.size() == 0 && gc_finalizer_state->running == 0; });
+	}
+
+	void gc_destroy_unsafe(vector<gc_handle*>& garbages)
+	{
+		if (garbages.size() == 0) return;
+		if (!gc_finalizer_state)
+		{
+			gc_finalize(garbages);
+			return;
+		}
+
+		lock_guard<mutex> guard(gc_finalizer_state->lock);
+		for (size_t i = 0; i < garbages.size(); i += gc_finalize_batch_size)
+		{
+			auto end = garbages.begin() + min(garbages.size(), i + gc_finalize_batch_size);
+			gc_finalizer_state->batches.push_back(vector<gc_handle*>(garbages.begin() + i, end));
+		}
+		gc_finalizer_state->queue_changed.notify_all();
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// stop-the-world collection
+	//////////////////////////////////////////////////////////////////
+
+	const size_t						gc_lazy_sweep_slice = 4096;	// slots swept after a collection by an allocation that needs another page, or whenever a log is flushed
+
+	// requires gc_lock and every log locked, marks with the parallel marker and leaves the cycle sweeping
+	void gc_cycle_collect_unsafe(vector<gc_handle*>& garbages, gc_trigger trigger)
+	{
+		gc_cycle_finish_unsafe(garbages);
+		gc_cycle_begin_unsafe(trigger);
+		auto start = chrono::steady_clock::now();
+		gc_mark_unsafe(gc_current_cycle.pages);
+		gc_current_cycle.event.mark_ms += gc_elapsed_ms(start);
+		gc_current_cycle.root_cursor = gc_current_cycle.pages.size();
+		gc_current_cycle.root_slots = 0;
+		gc_cycle_remark_unsafe();
+	}
+
+	// the heap size that makes the allocating thread collect, even if there is a collector thread
+	size_t gc_hard_limit_unsafe()
+	{
+		return gc_growth_ratio > 0 ? max(gc_max_size, gc_next_trigger) : gc_max_size;
+	}
+
+	bool gc_should_collect_unsafe()
+	{
+		if (gc_growth_ratio > 0) return gc_current_size > gc_next_trigger;
+
+		// minor collections could make the heap smaller than it was after the last major collection
+		return gc_current_size > gc_max_size || gc_current_size > gc_last_current_size + gc_step_size;
+	}
+
+	gc_trigger gc_collect_trigger_unsafe()
+	{
+		if (gc_current_size > gc_hard_limit_unsafe()) return gc_trigger::max;
+		return gc_growth_ratio > 0 ? gc_trigger::paced : gc_trigger::step;
+	}
+
+	// requires gc_lock, marks in one pause and leaves the garbages to be swept lazily
+	void gc_collect_unsafe(vector<gc_handle*>& garbages)
+	{
+		gc_lock_logs_unsafe();
+		gc_cycle_collect_unsafe(garbages, gc_collect_trigger_unsafe());
+		gc_unlock_logs_unsafe(gc_statistics.major_pauses);
+	}
+
+	// requires gc_lock
+	void gc_force_collect_unsafe(vector<gc_handle*>& garbages, gc_trigger trigger)
+	{
+		gc_lock_logs_unsafe();
+		gc_cycle_collect_unsafe(garbages, trigger);
+		gc_cycle_finish_unsafe(garbages);
+		gc_unlock_logs_unsafe(gc_statistics.major_pauses);
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// minor collection
+	//////////////////////////////////////////////////////////////////
+
+	unsigned char						gc_minor_epoch = 0;
+
+	void gc_minor_grey_unsafe(gc_handle* handle, vector<gc_handle*>& greys)
+	{
+		if (!handle->old && handle->minor_mark != gc_minor_epoch)
+		{
+			handle->minor_mark = gc_minor_epoch;
+			greys.push_back(handle);
+		}
+	}
+
+	// requires gc_lock and no running cycle, collects the nursery in one pause and assumes that old objects are alive
+	void gc_minor_collect_unsafe(vector<gc_handle*>& garbages)
+	{
+		assert(gc_current_cycle.phase == gc_phase::idle);
+		gc_lock_logs_unsafe();
+		if (gc_counting)
+		{
+			gc_rc_reclaim_unsafe();
+		}
+		gc_minor_epoch = gc_minor_epoch == 255 ? 1 : gc_minor_epoch + 1;
+		gc_statistics.minor_collections++;
+		gc_event event;
+		event.trigger = gc_trigger::nursery;
+		auto start = chrono::steady_clock::now();
+
+		vector<gc_handle*> greys;
+		for (auto handle : gc_nursery)
+		{
+			if (handle->counter > 0)
+			{
+				gc_minor_grey_unsafe(handle, greys);
+			}
+		}
+		auto grey = [&](gc_handle* child)
+		{
+			gc_minor_grey_unsafe(child, greys);
+		};
+		for (auto handle : gc_remembered)
+		{
+			gc_for_each_child_unsafe(handle, grey);
+		}
+		while (greys.size() > 0)
+		{
+			auto handle = greys.back();
+			greys.pop_back();
+			gc_for_each_child_unsafe(handle, grey);
+		}
+
+		event.mark_ms = gc_elapsed_ms(start);
+		start = chrono::steady_clock::now();
+
+		if (gc_counting)
+		{
+			auto alive = [](gc_handle* handle)
+			{
+				return handle->old || handle->minor_mark == gc_minor_epoch;
+			};
+			for (auto handle : gc_nursery)
+			{
+				if (!alive(handle))
+				{
+					gc_rc_forget_unsafe(handle);
+					gc_rc_release_edges_unsafe(handle, alive);
+				}
+			}
+		}
+
+		// survivors grow older, and the oldest of them leave the nursery
+		vector<gc_handle*> nursery;
+		vector<gc_handle*> promoted;
+		for (auto handle : gc_nursery)
+		{
+			if (handle->minor_mark != gc_minor_epoch)
+			{
+				handle->state = gc_handle_state::garbage;
+				handle->nursery_index = (size_t)-1;
+				gc_weak_clear_unsafe(handle);
+				gc_current_size -= handle->record.length;
+				event.freed_objects++;
+				event.freed_bytes += handle->record.length;
+				garbages.push_back(handle);
+			}
+			else if (++handle->age >= gc_promotion_age)
+			{
+				handle->old = true;
+				handle->nursery_index = (size_t)-1;
+				promoted.push_back(handle);
+			}
+			else
+			{
+				handle->nursery_index = nursery.size();
+				nursery.push_back(handle);
+			}
+		}
+		gc_nursery.swap(nursery);
+
+		// an old object is remembered only when it still references the nursery
+		for (auto it = gc_remembered.begin(); it != gc_remembered.end();)
+		{
+			if (gc_has_young_child_unsafe(*it))
+			{
+				it++;
+			}
+			else
+			{
+				(*it)->remembered = false;
+				it = gc_remembered.erase(it);
+			}
+		}
+		for (auto handle : promoted)
+		{
+			if (gc_has_young_child_unsafe(handle))
+			{
+				gc_remember_unsafe(handle);
+			}
+		}
+		gc_young_size = 0;
+		event.sweep_ms = gc_elapsed_ms(start);
+		event.live_bytes = gc_current_size;
+		gc_finish_collection_unsafe(event);
+		gc_unlock_logs_unsafe(gc_statistics.minor_pauses);
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// compaction
+	//
+	// Objects that can be moved are copied out of sparse pages in the
+	// order a breadth-first walk from the roots finds them, so that an
+	// object is followed by its children in new pages. Rooted and pinned
+	// objects stay where they are, because only the counter of a root is
+	// known, not its address. Afterwards every gc_ptr in the heap that
+	// points to a moved object is patched, and edges of registered
+	// objects are moved to the new addresses.
+	//////////////////////////////////////////////////////////////////
+
+	struct gc_compaction
+	{
+		vector<gc_page*>				pages;				// held by the arena until the compaction is finished
+		vector<gc_page*>				sources;			// pages that objects are moved out of
+		unordered_map<gc_handle*, gc_handle*>	moved;		// from old handles to new handles
+		vector<gc_handle*>				moved_handles;		// new handles in the order they are moved
+	};
+
+	// returns how far the object that contains the address is moved
+	ptrdiff_t gc_compact_offset_unsafe(gc_compaction& compaction, void* address)
+	{
+		if (!address) return 0;
+		auto page = gc_page_map_find(address);
+		if (!page || !page->evacuating) return 0;
+		auto slot = reinterpret_cast<gc_handle*>(gc_page_slot_of(page, address));
+		auto it = compaction.moved.find(slot);
+		return it == compaction.moved.end() ? 0 : (char*)it->second - (char*)it->first;
+	}
+
+	gc_handle* gc_compact_move_unsafe(gc_compaction& compaction, gc_handle* handle)
 	{
-		static const int				counter_range = (int32_t)0x80000000;
+		size_t size = gc_handle_size + handle->record.length;
+		auto moved = reinterpret_cast<gc_handle*>(gc_arena_evacuate_alloc(size));
+		ptrdiff_t offset = (char*)moved - (char*)handle;
 
-		int								counter = 0;
-		gc_record						record;
-		multiset<gc_handle*>			references;
-		multiset<void**>				handle_references;
-		bool							mark = false;
+		// the copy takes over the tables of both edge maps, so the old handle is never destroyed
+		memcpy((void*)moved, (void*)handle, size);
+		gc_set_mark(moved);
+		moved->record.start = (char*)moved->record.start + offset;
+		gc_trace_relocate_unsafe(handle->record.start, moved->record.start);
+		moved->record.handle = reinterpret_cast<enable_gc*>((char*)moved->record.handle + offset);
+		unsafe_functions::gc_relocate(moved->record.handle, offset);
+		if (moved->nursery_index != (size_t)-1)
+		{
+			gc_nursery[moved->nursery_index] = moved;
+		}
+		if (moved->candidate_index != (size_t)-1)
+		{
+			gc_rc_candidates[moved->candidate_index] = moved;
+		}
+		if (moved->remembered)
+		{
+			gc_remembered.erase(handle);
+			gc_remembered.insert(moved);
+		}
+		if (auto cell = moved->weak.load(memory_order_relaxed))
+		{
+			cell->target.store(moved, memory_order_relaxed);
+		}
+
+		compaction.moved.insert({ handle, moved });
+		compaction.moved_handles.push_back(moved);
+		return moved;
+	}
+
+	void gc_compact_walk_unsafe(gc_compaction& compaction)
+	{
+		// minor marks are free between minor collections
+		gc_minor_epoch = gc_minor_epoch == 255 ? 1 : gc_minor_epoch + 1;
+
+		vector<gc_handle*> queue;
+		auto visit = [&](gc_handle* handle)
+		{
+			if (handle->minor_mark == gc_minor_epoch) return;
+			handle->minor_mark = gc_minor_epoch;
+			queue.push_back(handle);
+
+			if (handle->relocatable && handle->pins == 0 && handle->counter == 0 && gc_page_of(handle)->evacuating)
+			{
+				gc_compact_move_unsafe(compaction, handle);
+			}
+		};
+
+		for (auto page : compaction.pages)
+		{
+			for (char* slot = page->slots; slot < gc_page_end(page); slot += page->slot_size)
+			{
+				auto handle = reinterpret_cast<gc_handle*>(slot);
+				if (handle->state == gc_handle_state::allocated && handle->counter > 0)
+				{
+					visit(handle);
+				}
+			}
+		}
+
+		// old copies are still allocated, so edges are followed through them
+		for (size_t i = 0; i < queue.size(); i++)
+		{
+			gc_for_each_child_unsafe(queue[i], visit);
+		}
+	}
+
+	void gc_compact_patch_unsafe(gc_compaction& compaction, gc_handle* handle)
+	{
+		auto patch = [&](void** field)
+		{
+			if (auto offset = gc_compact_offset_unsafe(compaction, *field))
+			{
+				*field = (char*)*field + offset;
+			}
+		};
+
+		if (handle->pointer_map)
+		{
+			gc_for_each_field_unsafe(handle, patch);
+		}
+		else
+		{
+			// fields of a moved object are registered at their old addresses
+			vector<gc_edge<void**>> fields;
+			for (auto& field : handle->handle_references)
+			{
+				if (gc_compact_offset_unsafe(compaction, field.first))
+				{
+					fields.push_back(field);
+				}
+			}
+			for (auto& field : fields)
+			{
+				handle->handle_references.add(field.first, -field.second);
+				handle->handle_references.add((void**)((char*)field.first + gc_compact_offset_unsafe(compaction, field.first)), field.second);
+			}
+			for (auto& field : handle->handle_references)
+			{
+				if (field.second > 0)
+				{
+					patch(field.first);
+				}
+			}
+		}
+
+		// a precise object only has edges with reference counting
+		vector<gc_edge<gc_handle*>> children;
+		for (auto& child : handle->references)
+		{
+			if (compaction.moved.count(child.first))
+			{
+				children.push_back(child);
+			}
+		}
+		for (auto& child : children)
+		{
+			handle->references.add(child.first, -child.second);
+			handle->references.add(compaction.moved[child.first], child.second);
+		}
+	}
+
+	// requires gc_lock, every log locked and no running cycle
+	void gc_compact_unsafe(double max_occupancy)
+	{
+		assert(gc_current_cycle.phase == gc_phase::idle);
+		auto start = chrono::steady_clock::now();
+
+		gc_compaction compaction;
+		gc_arena_hold(compaction.pages);
+		gc_arena_evacuate_begin(compaction.sources, max_occupancy);
+		gc_compact_walk_unsafe(compaction);
+
+		vector<void*> memories;
+		size_t moved_bytes = 0;
+		for (auto& moved : compaction.moved)
+		{
+			moved.first->state.store(gc_handle_state::free, memory_order_relaxed);
+			memories.push_back(moved.first);
+			moved_bytes += moved.first->record.length;
+		}
+		for (auto page : compaction.pages)
+		{
+			for (char* slot = page->slots; slot < gc_page_end(page); slot += page->slot_size)
+			{
+				auto handle = reinterpret_cast<gc_handle*>(slot);
+				if (handle->state == gc_handle_state::allocated)
+				{
+					gc_compact_patch_unsafe(compaction, handle);
+				}
+			}
+		}
+		for (auto handle : compaction.moved_handles)
+		{
+			gc_compact_patch_unsafe(compaction, handle);
+		}
+
+		gc_arena_free(memories.data(), memories.size());
+		gc_arena_evacuate_end(compaction.sources);
+		gc_arena_release();
+
+		gc_statistics.compactions++;
+		gc_statistics.moved_objects += memories.size();
+		gc_statistics.moved_bytes += moved_bytes;
+		gc_statistics.compact_ms += gc_elapsed_ms(start);
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// heap profile
+	//
+	// Live objects are grouped by the dynamic type of their enable_gc
+	// part. A retention path is found by a breadth-first walk from the
+	// rooted objects, it starts from an object that a gc_ptr outside of
+	// the heap points to, because the address of a root is unknown.
+	//////////////////////////////////////////////////////////////////
+
+	string gc_type_name(const type_info& type)
+	{
+#ifdef __GNUG__
+		int status = 0;
+		if (char* name = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status))
+		{
+			string result = name;
+			free(name);
+			return result;
+		}
+#endif
+		return type.name();
+	}
+
+	// objects whose constructor is running are not registered yet
+	string gc_type_name_unsafe(gc_handle* handle)
+	{
+		return handle->record.handle ? gc_type_name(typeid(*handle->record.handle)) : "(constructing)";
+	}
+
+	// requires gc_lock, every log locked and no running cycle
+	gc_heap_profile gc_profile_heap_unsafe()
+	{
+		unordered_map<type_index, gc_type_stats> types;
+		gc_heap_profile profile;
+		gc_for_each_handle_unsafe([&](gc_handle* handle)
+		{
+			auto type = handle->record.handle ? type_index(typeid(*handle->record.handle)) : type_index(typeid(void));
+			auto& stats = types[type];
+			if (stats.count == 0) stats.type = gc_type_name_unsafe(handle);
+			stats.count++;
+			stats.bytes += handle->record.length;
+			profile.objects++;
+			profile.bytes += handle->record.length;
+		});
+
+		for (auto& type : types)
+		{
+			profile.types.push_back(type.second);
+		}
+		sort(profile.types.begin(), profile.types.end(), [](const gc_type_stats& a, const gc_type_stats& b)
+		{
+			return a.type < b.type;
+		});
+		return profile;
+	}
+
+	// requires gc_lock, every log locked and no running cycle
+	// <ignored_roots> roots of the target are not counted, they are the gc_ptr that the caller passes in
+	vector<gc_retention_step> gc_retention_path_unsafe(gc_handle* target, int ignored_roots)
+	{
+		// minor marks are free between minor collections
+		gc_minor_epoch = gc_minor_epoch == 255 ? 1 : gc_minor_epoch + 1;
+
+		unordered_map<gc_handle*, gc_handle*> parents;
+		vector<gc_handle*> queue;
+		gc_for_each_handle_unsafe([&](gc_handle* handle)
+		{
+			if (handle->counter > (handle == target ? ignored_roots : 0))
+			{
+				handle->minor_mark = gc_minor_epoch;
+				queue.push_back(handle);
+			}
+		});
+
+		bool found = target->minor_mark == gc_minor_epoch;
+		for (size_t i = 0; i < queue.size() && !found; i++)
+		{
+			auto parent = queue[i];
+			gc_for_each_child_unsafe(parent, [&](gc_handle* child)
+			{
+				if (child->minor_mark == gc_minor_epoch) return;
+				child->minor_mark = gc_minor_epoch;
+				parents.insert({ child, parent });
+				queue.push_back(child);
+				found = found || child == target;
+			});
+		}
+
+		vector<gc_retention_step> path;
+		if (!found) return path;
+		for (auto handle = target; handle; )
+		{
+			gc_retention_step step;
+			step.type = gc_type_name_unsafe(handle);
+			step.object = handle->record.start;
+			step.bytes = handle->record.length;
+			path.push_back(step);
+
+			auto it = parents.find(handle);
+			handle = it == parents.end() ? nullptr : it->second;
+		}
+		reverse(path.begin(), path.end());
+		return path;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// incremental collection
+	//
+	// A step spends a budget of work units on the running cycle, one for
+	// each object traced and one for each slot scanned or swept. Only the
+	// remark at the end of marking is not bounded, it traces what has
+	// been recorded since the previous step.
+	//////////////////////////////////////////////////////////////////
+
+	const size_t						gc_collect_slice = 4096;	// work units of a step that is bounded by time
+
+	// requires gc_lock, advances the running cycle or starts one if it is time to collect, returns the work left
+	size_t gc_collect_step_unsafe(size_t budget, vector<gc_handle*>& garbages)
+	{
+		auto& cycle = gc_current_cycle;
+		if (cycle.phase == gc_phase::idle)
+		{
+			if (!gc_should_collect_unsafe()) return 0;
+			gc_lock_logs_unsafe();
+			gc_cycle_begin_unsafe(gc_collect_trigger_unsafe());
+			gc_unlock_logs_unsafe(gc_statistics.major_pauses);
+		}
+		if (cycle.phase == gc_phase::marking && gc_cycle_mark_unsafe(budget))
+		{
+			gc_lock_logs_unsafe();
+			gc_cycle_remark_unsafe();
+			gc_unlock_logs_unsafe(gc_statistics.major_pauses);
+		}
+		if (cycle.phase == gc_phase::sweeping && budget > 0)
+		{
+			gc_cycle_sweep_unsafe(budget, garbages);
+		}
+		return gc_cycle_remaining_unsafe();
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// collector thread
+	//
+	// With gc_options::background, exceeding <step_size> only wakes up
+	// the collector thread, which collects and runs destructors in place
+	// of the allocating thread. With gc_options::concurrent it takes
+	// gc_lock for one step at a time, so other threads only wait for it
+	// when they flush their logs. A thread that pushes the heap over
+	// <max_size> still collects, or finishes the running cycle, by itself.
+	//////////////////////////////////////////////////////////////////
+
+	struct gc_collector
+	{
+		thread							worker;
+		mutex							lock;
+		condition_variable				requested_changed;
+		bool							requested = false;
+		bool							stopping = false;
+	};
+
+	gc_collector*						gc_collector_state = nullptr;
+
+	// requires gc_lock
+	void gc_collector_notify_unsafe()
+	{
+		lock_guard<mutex> guard(gc_collector_state->lock);
+		gc_collector_state->requested = true;
+		gc_collector_state->requested_changed.notify_one();
+	}
+
+	void gc_collector_run()
+	{
+		if (!gc_concurrent)
+		{
+			// marks in one pause, and then sweeps in steps
+			vector<gc_handle*> garbages;
+			{
+				lock_guard<mutex> guard(gc_lock);
+				if (gc_current_cycle.phase == gc_phase::idle && gc_should_collect_unsafe())
+				{
+					gc_collect_unsafe(garbages);
+				}
+			}
+			gc_destroy_unsafe(garbages);
+			gc_report_events();
+		}
+
+		while (true)
+		{
+			vector<gc_handle*> garbages;
+			size_t remaining = 0;
+			{
+				lock_guard<mutex> guard(gc_lock);
+				remaining = gc_collect_step_unsafe(gc_collect_slice, garbages);
+			}
+			gc_destroy_unsafe(garbages);
+			gc_report_events();
+			if (remaining == 0) return;
+			this_thread::yield();
+		}
+	}
+
+	void gc_collector_worker(gc_collector& collector)
+	{
+		while (true)
+		{
+			{
+				unique_lock<mutex> guard(collector.lock);
+				collector.requested_changed.wait(guard, [&]() { return collector.stopping || collector.requested; });
+				if (collector.stopping) return;
+				collector.requested = false;
+			}
+			gc_collector_run();
+		}
+	}
+
+	void gc_collector_start()
+	{
+		assert(!gc_collector_state);
+		gc_collector_state = new gc_collector;
+		gc_collector_state->worker = thread(gc_collector_worker, ref(*gc_collector_state));
+	}
+
+	// the running cycle is finished before the thread exits
+	void gc_collector_stop()
+	{
+		if (!gc_collector_state) return;
+		{
+			lock_guard<mutex> guard(gc_collector_state->lock);
+			gc_collector_state->stopping = true;
+			gc_collector_state->requested_changed.notify_one();
+		}
+		gc_collector_state->worker.join();
+		delete gc_collector_state;
+		gc_collector_state = nullptr;
+	}
+
+	void gc_flush_log(gc_ref_log& log)
+	{
+		vector<gc_handle*> garbages;
+		{
+			unique_lock<mutex> guard(gc_lock, defer_lock);
+			if (!guard.try_lock())
+			{
+				auto start = chrono::steady_clock::now();
+				guard.lock();
+				gc_lock_wait_ns += gc_elapsed_ns(start);
+			}
+			if (!gc_running) return;
+			{
+				lock_guard<gc_spin_lock> log_guard(log.lock);
+				gc_drain_log_unsafe(log);
+			}
+			if (gc_counting && gc_current_cycle.phase != gc_phase::marking)
+			{
+				// trial deletion takes the place of marking unless the heap exceeds <max_size>
+				bool cycles = gc_rc_candidates.size() >= gc_rc_candidate_limit || (gc_rc_candidates.size() > 0 && gc_should_collect_unsafe() && gc_current_size <= gc_hard_limit_unsafe());
+				if (cycles || gc_rc_zeros.size() > 0)
+				{
+					gc_lock_logs_unsafe();
+					gc_rc_reclaim_unsafe();
+					if (cycles)
+					{
+						gc_rc_collect_cycles_unsafe();
+						gc_rc_reclaim_unsafe();
+					}
+					gc_unlock_logs_unsafe();
+				}
+			}
+			if (gc_current_size > gc_hard_limit_unsafe())
+			{
+				if (gc_current_cycle.phase != gc_phase::idle)
+				{
+					// the running cycle falls behind, it is finished here instead of starting another one
+					gc_lock_logs_unsafe();
+					gc_cycle_finish_unsafe(garbages);
+					gc_unlock_logs_unsafe(gc_statistics.major_pauses);
+				}
+				else
+				{
+					gc_force_collect_unsafe(garbages, gc_trigger::max);
+				}
+			}
+			else if (gc_nursery_size > 0 && gc_young_size > gc_nursery_size && gc_current_cycle.phase == gc_phase::idle && !gc_should_collect_unsafe())
+			{
+				gc_minor_collect_unsafe(garbages);
+			}
+			else if (gc_collector_state)
+			{
+				if (gc_current_cycle.phase == gc_phase::idle && gc_should_collect_unsafe())
+				{
+					gc_collector_notify_unsafe();
+				}
+			}
+			else if (gc_incremental_budget > 0)
+			{
+				gc_collect_step_unsafe(gc_incremental_budget, garbages);
+			}
+			else if (gc_current_cycle.phase == gc_phase::sweeping)
+			{
+				// allocations that need another page sweep first, this also finishes the sweep for threads that do not allocate
+				size_t budget = gc_lazy_sweep_slice;
+				gc_cycle_sweep_unsafe(budget, garbages);
+			}
+			else if (gc_should_collect_unsafe())
+			{
+				gc_collect_unsafe(garbages);
+			}
+			if (gc_counting)
+			{
+				gc_rc_take_garbages_unsafe(log.garbages);
+			}
+		}
+		gc_destroy_unsafe(garbages);
+		gc_report_events();
+	}
+
+	// destroys garbages that the last flush of this thread freed by reference counting, once the operation that flushed has returned
+	// objects that they release in their destructors are destroyed by the same loop instead of a nested one
+	void gc_destroy_counted(gc_ref_log& log)
+	{
+		if (log.destroying) return;
+		log.destroying = true;
+		while (log.garbages.size() > 0)
+		{
+			vector<gc_handle*> garbages;
+			garbages.swap(log.garbages);
+			gc_destroy_unsafe(garbages);
+		}
+		log.destroying = false;
+	}
+
+	// sweeps a slice before the arena gives another page to the current thread, so that the allocation may reuse garbages of the last collection
+	void gc_sweep_on_demand()
+	{
+		vector<gc_handle*> garbages;
+		{
+			lock_guard<mutex> guard(gc_lock);
+			if (!gc_running || gc_collector_state || gc_incremental_budget > 0 || gc_current_cycle.phase != gc_phase::sweeping) return;
+			size_t budget = gc_lazy_sweep_slice;
+			gc_cycle_sweep_unsafe(budget, garbages);
+		}
+		gc_destroy_unsafe(garbages);
+		gc_report_events();
+	}
+
+	// returns the log of the current thread, locked
+	gc_ref_log& gc_enter_log()
+	{
+		auto& log = gc_local_log;
+		if (log.garbages.size() > 0)
+		{
+			gc_destroy_counted(log);
+		}
+		if (!log.registered)
+		{
+			lock_guard<mutex> guard(gc_lock);
+			gc_ref_logs.push_back(&log);
+			log.registered = true;
+		}
+		if (!log.lock.try_lock())
+		{
+			// only a collector that locks every log could hold it
+			auto start = chrono::steady_clock::now();
+			log.lock.lock();
+			gc_lock_wait_ns += gc_elapsed_ns(start);
+		}
+		return log;
+	}
+
+	void gc_leave_log(gc_ref_log& log)
+	{
+		// a log always has room for the two entries of a move
+		bool flush = log.count >= gc_ref_log_capacity - 1 || log.allocated_size >= gc_alloc_batch_size;
+		log.lock.unlock();
+		if (flush)
+		{
+			gc_flush_log(log);
+		}
+	}
+
+	// returns false if the change does not need to be logged, entry.parent should be found before calling it
+	bool gc_prepare_ref(gc_ref_entry& entry, void** handle_reference, void* old_handle, void* new_handle, gc_ref_op op)
+	{
+		if (!entry.parent && old_handle == new_handle) return false;
+		if (entry.parent && entry.parent->state == gc_handle_state::garbage)
+		{
+			// fields of a garbage are released by its destructor, the collector has already forgotten them
+			return false;
+		}
+		if (entry.parent && entry.parent->pointer_map && op != gc_ref_op::ref)
+		{
+			// fields of a precise object are found by its pointer map, unless it has been promoted while being constructed
+			// reference counting needs their edges but not their addresses
+			if (gc_counting) op = gc_ref_op::ref;
+			else if (!(entry.parent->old && new_handle)) return false;
+		}
+		entry.handle_reference = handle_reference;
+		entry.old_target = gc_find_unsafe(old_handle);
+		entry.new_target = gc_find_unsafe(new_handle);
+		entry.op = entry.parent ? op : gc_ref_op::ref;
+		return entry.op != gc_ref_op::ref || entry.old_target != entry.new_target;
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// private heaps
+	//
+	// A gc_heap is a space with a stop-the-world collector of its own.
+	// Changes to its objects are applied when they happen instead of
+	// being logged. The parent of an edge is in the same heap as its
+	// targets, and a root that moves from one heap to another is split,
+	// so that the shared part is logged as usual. Objects are marked from
+	// those whose counter is not zero, like in the shared heap.
+	//////////////////////////////////////////////////////////////////
+
+	struct gc_heap_state : gc_space
+	{
+		size_t							step_size = 0;
+		size_t							current_size = 0;	// bytes of allocated objects
+		size_t							last_size = 0;		// bytes alive after the last collection
+		bool							collecting = false;	// destructors that allocate do not start another collection
+		vector<gc_handle*>				weak_targets;		// objects that have a weak cell
 	};
 
-	struct gc_handle_dummy
+	atomic<int>							gc_private_heaps(0);
+
+	// returns the private heap of an object, or nullptr if it is in the shared heap
+	gc_heap_state* gc_heap_of(void* handle)
+	{
+		if (!handle) return nullptr;
+		return static_cast<gc_heap_state*>(gc_page_of((char*)handle - gc_handle_size)->space);
+	}
+
+	template<typename F>
+	void gc_heap_for_each_handle(gc_heap_state* heap, F&& callback)
+	{
+		for (auto page : heap->pages)
+		{
+			for (char* slot = page->slots; slot < gc_page_end(page); slot += page->slot_size)
+			{
+				auto handle = reinterpret_cast<gc_handle*>(slot);
+				if (handle->state == gc_handle_state::allocated)
+				{
+					callback(handle);
+				}
+			}
+		}
+	}
+
+	bool gc_has_private_heaps()
+	{
+		return gc_private_heaps.load(memory_order_relaxed) > 0;
+	}
+
+	// a reference across heaps would be missed by both collectors, so it stops the program even without assert
+	void gc_fail_cross_heap()
 	{
-		int								counter = 0;
-		gc_record						record;
-	};
+		fprintf(stderr, "vczh::gc_ptr: an object references an object in another heap\n");
+		abort();
+	}
 
-	struct gc_handle_comparer
+	// returns true if the change is applied, otherwise its shared part is left in <old_handle> and <new_handle> to be logged
+	bool gc_apply_private(gc_handle* parent, void** handle_reference, void*& old_handle, void*& new_handle, gc_ref_op op)
 	{
-		bool operator ()(gc_handle* a, gc_handle* b) const
+		auto heap = parent ? static_cast<gc_heap_state*>(gc_page_of(parent)->space) : nullptr;
+		auto old_heap = gc_heap_of(old_handle);
+		auto new_heap = gc_heap_of(new_handle);
+		if (heap)
 		{
-			if (a->counter == gc_handle::counter_range)
-			{
-				return a->record.start < b->record.start;
-			}
-			if (b->counter == gc_handle::counter_range)
-			{
-				return (intptr_t)(a->record.start) + a->record.length <= (intptr_t)b->record.start;
-			}
-			else
+			if ((old_handle && old_heap != heap) || (new_handle && new_heap != heap)) gc_fail_cross_heap();
+			gc_ref_entry entry;
+			entry.parent = parent;
+			if (gc_prepare_ref(entry, handle_reference, old_handle, new_handle, op))
 			{
-				return a->record.start < b->record.start;
+				gc_apply_edges_unsafe(entry);
 			}
+			return true;
 		}
-	};
-
-	typedef set<gc_handle*, gc_handle_comparer>		gc_handle_container;
-	mutex								gc_lock;
-	gc_handle_container*				gc_handles = nullptr;
-	size_t								gc_step_size = 0;
-	size_t								gc_max_size = 0;
-	size_t								gc_last_current_size = 0;
-	size_t								gc_current_size = 0;
+		if (!old_heap && !new_heap) return false;
 
-	gc_handle* gc_find_unsafe(void* handle)
-	{
-		gc_handle_dummy dummy;
-		dummy.record.start = handle;
-		gc_handle* input = reinterpret_cast<gc_handle*>(&dummy);
-		auto it = gc_handles->find(input);
-		return it == gc_handles->end() ? nullptr : *it;
+		// objects in the shared heap cannot reference objects in private heaps
+		if (parent) gc_fail_cross_heap();
+		if (old_heap)
+		{
+			if (auto target = gc_find_unsafe(old_handle)) gc_add_roots(target, -1);
+			old_handle = nullptr;
+		}
+		if (new_heap)
+		{
+			if (auto target = gc_find_unsafe(new_handle)) gc_add_roots(target, 1);
+			new_handle = nullptr;
+		}
+		return !old_handle && !new_handle;
 	}
 
-	gc_handle* gc_find_parent_unsafe(void** handle_reference)
+	void gc_heap_destroy(gc_heap_state* heap, vector<gc_handle*>& garbages)
 	{
-		gc_handle_dummy dummy;
-		dummy.counter = gc_handle::counter_range;
-		dummy.record.start = (void*)handle_reference;
-		gc_handle* input = reinterpret_cast<gc_handle*>(&dummy);
-		auto it = gc_handles->find(input);
-		return it == gc_handles->end() ? nullptr : *it;
+		for (auto handle : garbages)
+		{
+			gc_destroy_disconnect_unsafe(handle);
+		}
+
+		// destructors may allocate, so slots are freed only after all of them are done
+		for (auto handle : garbages)
+		{
+			heap->current_size -= handle->record.length;
+			handle->record.handle->~enable_gc();
+			handle->state = gc_handle_state::free;
+			handle->~gc_handle();
+		}
+		for (auto handle : garbages)
+		{
+			gc_space_free(heap, handle);
+		}
 	}
 
-	void gc_ref_connect_unsafe(void** handle_reference, void* handle, bool alloc)
+	void gc_heap_collect(gc_heap_state* heap)
 	{
-		gc_handle* parent = nullptr;
-		if (alloc)
+		if (heap->collecting) return;
+		heap->collecting = true;
+
+		for (auto page : heap->pages)
+		{
+			gc_page_clear_marks(page);
+		}
+		vector<gc_handle*> greys;
+		auto grey = [&](gc_handle* handle)
 		{
-			if (parent = gc_find_parent_unsafe(handle_reference))
+			if (gc_try_mark(handle))
 			{
-				parent->handle_references.insert(handle_reference);
+				gc_prefetch(handle);
+				greys.push_back(handle);
 			}
+		};
+		for (auto page : heap->pages)
+		{
+			gc_for_each_rooted_slot(page, grey);
 		}
-		if (auto target = gc_find_unsafe(handle))
+		while (greys.size() > 0)
+		{
+			auto handle = greys.back();
+			greys.pop_back();
+			gc_for_each_child_unsafe(handle, grey);
+		}
+
+		vector<gc_handle*> garbages;
+		for (auto page : heap->pages)
 		{
-			if (parent || (parent = gc_find_parent_unsafe(handle_reference)))
+			gc_for_each_unmarked_slot(page, [&](gc_handle* handle)
 			{
-				parent->references.insert(target);
-				if (alloc)
+				if (handle->state == gc_handle_state::allocated)
 				{
-					parent->handle_references.insert(handle_reference);
+					handle->state = gc_handle_state::garbage;
+					gc_weak_clear_unsafe(handle);
+					garbages.push_back(handle);
 				}
-			}
-			else
-			{
-				target->counter++;
-			}
+			});
 		}
+		auto& weak_targets = heap->weak_targets;
+		weak_targets.erase(remove_if(weak_targets.begin(), weak_targets.end(), [](gc_handle* handle)
+		{
+			return handle->state != gc_handle_state::allocated;
+		}), weak_targets.end());
+
+		gc_heap_destroy(heap, garbages);
+		gc_space_trim(heap);
+		heap->last_size = heap->current_size;
+		heap->collecting = false;
 	}
 
-	void gc_ref_disconnect_unsafe(void** handle_reference, void* handle, bool dealloc)
+	void gc_heap_alloc(gc_heap_state* heap, gc_record& record, gc_pointer_map* pointer_map, bool relocatable)
 	{
-		gc_handle* parent = nullptr;
-		if (dealloc)
+		if (heap->current_size - heap->last_size >= heap->step_size)
 		{
-			if (parent = gc_find_parent_unsafe(handle_reference))
-			{
-				parent->handle_references.insert(handle_reference);
-			}
+			gc_heap_collect(heap);
 		}
-		if (auto target = gc_find_unsafe(handle))
+
+		void* memory = gc_space_alloc(heap, gc_handle_size + record.length);
+		record.start = (char*)memory + gc_handle_size;
+		if (pointer_map)
+		{
+			memset(record.start, 0, record.length);
+		}
+
+		auto handle = gc_handle_construct(memory);
+		handle->record = record;
+		gc_add_roots(handle, 1);
+		handle->pointer_map = pointer_map;
+		handle->relocatable = relocatable;
+		handle->state.store(gc_handle_state::allocated, memory_order_relaxed);
+		heap->current_size += record.length;
+	}
+
+	void gc_log_ref(void** handle_reference, void* old_handle, void* new_handle, gc_ref_op op)
+	{
+		gc_ref_entry entry;
+		entry.parent = gc_find_parent_unsafe(handle_reference);
+		if (gc_has_private_heaps() && gc_apply_private(entry.parent, handle_reference, old_handle, new_handle, op)) return;
+		if (!gc_prepare_ref(entry, handle_reference, old_handle, new_handle, op)) return;
+
+		auto& log = gc_enter_log();
+		log.entries[log.count++] = entry;
+		gc_leave_log(log);
+	}
+
+	struct gc_ref_change
+	{
+		void**							handle_reference;
+		void*							old_handle;
+		void*							new_handle;
+		gc_ref_op						op;
+	};
+
+	// logs two changes that move a reference from one gc_ptr to another in one entrance of the log
+	// when both gc_ptr are roots, the counter that one of them increases and the other decreases is left alone
+	void gc_log_refs(gc_ref_change first, gc_ref_change second)
+	{
+		gc_ref_entry entries[2];
+		entries[0].parent = gc_find_parent_unsafe(first.handle_reference);
+		entries[1].parent = gc_find_parent_unsafe(second.handle_reference);
+		bool heaps = gc_has_private_heaps();
+		bool applied[2] =
 		{
-			if (parent || (parent = gc_find_parent_unsafe(handle_reference)))
+			heaps && gc_apply_private(entries[0].parent, first.handle_reference, first.old_handle, first.new_handle, first.op),
+			heaps && gc_apply_private(entries[1].parent, second.handle_reference, second.old_handle, second.new_handle, second.op),
+		};
+		if (!entries[0].parent && !entries[1].parent)
+		{
+			// objects are not touched, so that sorting a vector of gc_ptr does not read every object it moves
+			if (first.new_handle == second.old_handle)
 			{
-				if (dealloc)
-				{
-					parent->handle_references.erase(handle_reference);
-				}
-				parent->references.erase(target);
+				first.new_handle = second.old_handle = nullptr;
 			}
-			else
+			if (first.old_handle == second.new_handle)
+			{
+				first.old_handle = second.new_handle = nullptr;
+			}
+		}
+		bool logged[2] =
+		{
+			!applied[0] && gc_prepare_ref(entries[0], first.handle_reference, first.old_handle, first.new_handle, first.op),
+			!applied[1] && gc_prepare_ref(entries[1], second.handle_reference, second.old_handle, second.new_handle, second.op),
+		};
+		if (!logged[0] && !logged[1]) return;
+
+		auto& log = gc_enter_log();
+		for (int i = 0; i < 2; i++)
+		{
+			if (logged[i])
 			{
-				target->counter--;
+				log.entries[log.count++] = entries[i];
 			}
 		}
+		gc_leave_log(log);
 	}
 
-	void gc_destroy_disconnect_unsafe(gc_handle* handle)
+	void gc_collect_all()
 	{
-		for (auto handle_reference : handle->handle_references)
+		vector<gc_handle*> garbages;
 		{
-			auto x = reinterpret_cast<gc_ptr<enable_gc>*>(handle_reference);
-			*handle_reference = nullptr;
+			lock_guard<mutex> guard(gc_lock);
+			gc_force_collect_unsafe(garbages, gc_trigger::forced);
+			gc_rc_take_garbages_unsafe(garbages);
 		}
+		gc_destroy_unsafe(garbages);
+		gc_report_events();
+		gc_finalizer_wait();
 	}
 
-	void gc_destroy_unsafe(gc_handle* handle)
+	// collects, then calls f with gc_lock and every log locked, when only live objects are allocated
+	template<typename F>
+	void gc_after_collect(F&& f)
 	{
-		handle->record.handle->~enable_gc();
-		gc_current_size -= handle->record.length;
-		free(handle->record.start);
-		delete handle;
+		assert(gc_running);
+		gc_collect_all();
+
+		vector<gc_handle*> garbages;
+		{
+			lock_guard<mutex> guard(gc_lock);
+			gc_lock_logs_unsafe();
+			gc_cycle_finish_unsafe(garbages);
+			if (gc_counting)
+			{
+				// gc_compact does not move objects that are waiting to be freed
+				gc_rc_reclaim_unsafe();
+				gc_rc_take_garbages_unsafe(garbages);
+			}
+			f();
+			gc_unlock_logs_unsafe(gc_statistics.major_pauses);
+		}
+		gc_destroy_unsafe(garbages);
+		gc_report_events();
 	}
 
-	void gc_destroy_unsafe(vector<gc_handle*>& garbages)
+#ifndef NDEBUG
+	// asserts that GC_POINTERS lists every gc_ptr member that registered itself while the first object of a type was constructed
+	// a member that is not listed would never be scanned once the layout is learned
+	void gc_check_pointers(void* memory, void* item, size_t stride, const vector<void*>& pointers)
 	{
-		for (auto handle : garbages)
+		auto handle = gc_find_unsafe(memory);
+		char* begin = (char*)item;
+		char* end = stride ? begin + stride : (char*)memory + handle->record.length;
+		unordered_map<void**, int> registered;
+		auto count = [&](void** handle_reference, int delta)
 		{
-			gc_destroy_disconnect_unsafe(handle);
+			if ((char*)handle_reference >= begin && (char*)handle_reference < end) registered[handle_reference] += delta;
+		};
+
+		// only this thread changes fields of the new object, and its log is not applied while it is locked
+		auto& log = gc_enter_log();
+		for (auto& edge : handle->handle_references)
+		{
+			count(edge.first, edge.second);
 		}
-		for (auto handle : garbages)
+		for (size_t i = 0; i < log.count; i++)
 		{
-			gc_destroy_unsafe(handle);
+			auto& entry = log.entries[i];
+			if (entry.parent != handle) continue;
+			if (entry.op == gc_ref_op::alloc) count(entry.handle_reference, 1);
+			else if (entry.op == gc_ref_op::dealloc) count(entry.handle_reference, -1);
 		}
-		gc_last_current_size = gc_current_size;
-	}
-
-	void gc_force_collect_unsafe(vector<gc_handle*>& garbages)
-	{
-		vector<gc_handle*> markings;
+		log.lock.unlock();
 
-		for (auto handle : *gc_handles)
+		size_t members = 0;
+		for (auto& member : registered)
 		{
-			if (handle->mark = handle->counter > 0)
+			if (member.second > 0)
 			{
-				markings.push_back(handle);
+				members++;
+				assert(find(pointers.begin(), pointers.end(), (void*)member.first) != pointers.end() && "GC_POINTERS does not list every gc_ptr member");
 			}
 		}
+		assert(members == pointers.size() && "GC_POINTERS lists a field that is not a gc_ptr member");
+	}
+#endif
 
-		for (int i = 0; i < (int)markings.size(); i++)
+	namespace unsafe_functions
+	{
+		void gc_alloc(gc_record& record, gc_pointer_map* pointer_map, bool relocatable, gc_heap* heap)
 		{
-			auto ref = markings[i];
-			for (auto child : ref->references)
+			assert(gc_running);
+			if (heap)
 			{
-				if (!child->mark)
-				{
-					child->mark = true;
-					markings.push_back(child);
-				}
+				gc_heap_alloc(heap->state, record, pointer_map, relocatable);
+				if (gc_tracing) gc_trace_alloc(record, pointer_map, relocatable, heap);
+				return;
 			}
-		}
 
-		for (auto it = gc_handles->begin(); it != gc_handles->end();)
-		{
-			if (!(*it)->mark)
+			size_t size = gc_handle_size + record.length;
+			if (gc_current_cycle.phase.load(memory_order_relaxed) == gc_phase::sweeping && !gc_arena_has_local_slot(size))
 			{
-				auto it2 = it++;
-				garbages.push_back(*it2);
-				gc_handles->erase(it2);
+				gc_sweep_on_demand();
 			}
-			else
+			void* memory = gc_arena_alloc(size);
+			record.start = (char*)memory + gc_handle_size;
+			if (pointer_map)
 			{
-				it++;
+				// a precise object could be scanned before its fields are constructed
+				memset(record.start, 0, record.length);
 			}
+
+			// the new object is protected by a counter until make_gc returns, and is not swept by the running cycle
+			auto& log = gc_enter_log();
+			auto handle = gc_handle_construct(memory);
+			handle->record = record;
+			gc_add_roots(handle, 1);
+			handle->pointer_map = pointer_map;
+			handle->relocatable = relocatable;
+			gc_set_mark(handle);
+			handle->state.store(gc_handle_state::allocated, memory_order_release);
+			log.allocated_size += record.length;
+			if (gc_nursery_size > 0)
+			{
+				log.allocated.push_back(handle);
+			}
+			gc_leave_log(log);
+			if (gc_tracing) gc_trace_alloc(record, pointer_map, relocatable, heap);
 		}
-	}
 
-	namespace unsafe_functions
-	{
-		void gc_alloc(gc_record record)
+		void gc_learn_pointers(gc_pointer_map* pointer_map, void* memory, void* item, size_t stride, const vector<void*>& pointers)
 		{
-			assert(gc_handles);
-			auto handle = new gc_handle;
-			handle->record = record;
-			handle->counter = 1;
+			static mutex learn_lock;
+			lock_guard<mutex> guard(learn_lock);
+			if (pointer_map->ready.load(memory_order_relaxed)) return;
+#ifndef NDEBUG
+			gc_check_pointers(memory, item, stride, pointers);
+#endif
 
-			vector<gc_handle*> garbages;
+			for (auto pointer : pointers)
 			{
-				lock_guard<mutex> guard(gc_lock);
-				gc_handles->insert(handle);
-				gc_current_size += handle->record.length;
-
-				if (gc_current_size > gc_max_size)
-				{
-					gc_force_collect_unsafe(garbages);
-				}
-				else if (gc_current_size - gc_last_current_size > gc_step_size)
-				{
-					gc_force_collect_unsafe(garbages);
-				}
+				assert((char*)pointer >= (char*)item && (char*)pointer < (char*)memory + gc_find_unsafe(memory)->record.length);
+				pointer_map->offsets.push_back((char*)pointer - (char*)item);
 			}
-			gc_destroy_unsafe(garbages);
+			pointer_map->first = (char*)item - (char*)memory;
+			pointer_map->stride = stride;
+			if (gc_tracing) gc_trace_learn(pointer_map);	// before another thread could allocate with it
+			pointer_map->ready.store(true, memory_order_release);
 		}
 
 		void gc_register(void* reference, enable_gc* handle)
 		{
-			assert(gc_handles);
+			assert(gc_running);
+			if (gc_tracing) gc_trace_attach(reference, handle);
+			if (gc_has_private_heaps() && gc_heap_of(reference))
+			{
+				gc_find_unsafe(reference)->record.handle = handle;
+				return;
+			}
 
-			lock_guard<mutex> guard(gc_lock);
+			auto& log = gc_enter_log();
 			gc_find_unsafe(reference)->record.handle = handle;
+			log.lock.unlock();
 		}
 
 		void gc_ref_alloc(void** handle_reference, void* handle)
 		{
-			assert(gc_handles);
-
-			lock_guard<mutex> guard(gc_lock);
-			gc_ref_connect_unsafe(handle_reference, handle, true);
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::ref_alloc, handle_reference, nullptr, handle, nullptr);
+			gc_log_ref(handle_reference, nullptr, handle, gc_ref_op::alloc);
 		}
 
 		void gc_ref_dealloc(void** handle_reference, void* handle)
 		{
-			assert(gc_handles);
-
-			lock_guard<mutex> guard(gc_lock);
-			gc_ref_disconnect_unsafe(handle_reference, handle, true);
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::ref_dealloc, handle_reference, nullptr, nullptr, nullptr);
+			gc_log_ref(handle_reference, handle, nullptr, gc_ref_op::dealloc);
 		}
 
 		void gc_ref(void** handle_reference, void* old_handle, void* new_handle)
 		{
-			assert(gc_handles);
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::ref, handle_reference, nullptr, new_handle, nullptr);
+			gc_log_ref(handle_reference, old_handle, new_handle, gc_ref_op::ref);
+		}
+
+		void gc_ref_move_alloc(void** handle_reference, void** source_reference, void* handle)
+		{
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::move_alloc, handle_reference, source_reference, handle, nullptr);
+			gc_log_refs(
+				{ handle_reference, nullptr, handle, gc_ref_op::alloc },
+				{ source_reference, handle, nullptr, gc_ref_op::ref }
+				);
+		}
+
+		void gc_ref_move(void** handle_reference, void** source_reference, void* old_handle, void* new_handle)
+		{
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::move, handle_reference, source_reference, new_handle, nullptr);
+			gc_log_refs(
+				{ handle_reference, old_handle, new_handle, gc_ref_op::ref },
+				{ source_reference, new_handle, nullptr, gc_ref_op::ref }
+				);
+		}
+
+		void gc_ref_swap(void** handle_reference, void** other_reference, void* handle, void* other_handle)
+		{
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::swap, handle_reference, other_reference, handle, other_handle);
+			gc_log_refs(
+				{ handle_reference, handle, other_handle, gc_ref_op::ref },
+				{ other_reference, other_handle, handle, gc_ref_op::ref }
+				);
+		}
+
+		void gc_ref_adopt(void** handle_reference, void* handle)
+		{
+			assert(gc_running);
+			if (gc_tracing) gc_trace_ref(gc_trace_op::adopt, handle_reference, nullptr, handle, nullptr);
+			gc_log_refs(
+				{ handle_reference, nullptr, handle, gc_ref_op::ref },
+				{ nullptr, handle, nullptr, gc_ref_op::ref }
+				);
+		}
+
+		void gc_pin(void* handle, bool pin)
+		{
+			assert(gc_running);
+			if (!handle) return;
+			if (gc_tracing) gc_trace_object(pin ? gc_trace_op::pin : gc_trace_op::unpin, handle, nullptr);
 
 			lock_guard<mutex> guard(gc_lock);
-			gc_ref_disconnect_unsafe(handle_reference, old_handle, false);
-			gc_ref_connect_unsafe(handle_reference, new_handle, false);
+			auto target = gc_find_unsafe(handle);
+			assert(pin || target->pins > 0);
+			if (pin) target->pins++;
+			else target->pins--;
+		}
+
+		gc_weak_cell* gc_weak_alloc(void* handle)
+		{
+			assert(gc_running);
+			auto target = gc_find_unsafe(handle);
+			auto cell = target->weak.load(memory_order_acquire);
+			if (!cell)
+			{
+				// one counter for the new gc_weak_ptr and one for the object
+				auto created = new gc_weak_cell;
+				created->target.store(target, memory_order_relaxed);
+				created->counter.store(2, memory_order_relaxed);
+				if (target->weak.compare_exchange_strong(cell, created, memory_order_acq_rel))
+				{
+					if (auto heap = gc_heap_of(handle))
+					{
+						heap->weak_targets.push_back(target);
+					}
+					if (gc_tracing) gc_trace_object(gc_trace_op::weak_alloc, handle, created);
+					return created;
+				}
+				delete created;
+			}
+			cell->counter.fetch_add(1, memory_order_relaxed);
+			if (gc_tracing) gc_trace_object(gc_trace_op::weak_alloc, handle, cell);
+			return cell;
+		}
+
+		void gc_weak_retain(gc_weak_cell* cell)
+		{
+			if (gc_tracing) gc_trace_weak(gc_trace_op::weak_retain, cell, nullptr, false);
+			cell->counter.fetch_add(1, memory_order_relaxed);
+		}
+
+		void gc_weak_release(gc_weak_cell* cell)
+		{
+			if (gc_tracing) gc_trace_weak(gc_trace_op::weak_release, cell, nullptr, false);
+			gc_weak_unref(cell);
+		}
+
+		bool gc_weak_expired(gc_weak_cell* cell)
+		{
+			return cell->target.load(memory_order_acquire) == nullptr;
+		}
+
+		void* gc_weak_lock(void** handle_reference, gc_weak_cell* cell)
+		{
+			assert(gc_running);
+			gc_ref_entry entry;
+			entry.parent = gc_find_parent_unsafe(handle_reference);
+
+			auto& log = gc_enter_log();
+			cell->lock.lock();
+			auto target = cell->target.load(memory_order_relaxed);
+			if (target && gc_page_of(target)->space)
+			{
+				// a private heap clears the cell when it sweeps the object
+				void* handle = target->record.start;
+				void* old_handle = nullptr;
+				void* new_handle = handle;
+				gc_apply_private(entry.parent, handle_reference, old_handle, new_handle, gc_ref_op::ref);
+				cell->lock.unlock();
+				log.lock.unlock();
+				if (gc_tracing) gc_trace_weak(gc_trace_op::weak_lock, cell, handle_reference, true);
+				return handle;
+			}
+
+			bool marking = gc_current_cycle.phase.load(memory_order_acquire) == gc_phase::marking;
+			if (target && !marking && !gc_is_marked(target))
+			{
+				// outside of marking every object that is alive is marked, this one is waiting to be swept
+				target = nullptr;
+			}
+
+			void* handle = nullptr;
+			if (target)
+			{
+				handle = target->record.start;
+				if (gc_prepare_ref(entry, handle_reference, nullptr, handle, gc_ref_op::ref))
+				{
+					log.entries[log.count++] = entry;
+				}
+				if (marking)
+				{
+					// an object that is only weakly reachable is not in the snapshot of the running cycle, it is greyed like a target that loses a reference
+					log.entries[log.count++] = { nullptr, nullptr, target, target, gc_ref_op::ref };
+				}
+			}
+			cell->lock.unlock();
+			gc_leave_log(log);
+			if (gc_tracing) gc_trace_weak(gc_trace_op::weak_lock, cell, handle_reference, handle != nullptr);
+			return handle;
+		}
+
+		vector<gc_retention_step> gc_retention_path(void* handle, int ignored_roots)
+		{
+			vector<gc_retention_step> path;
+			if (!handle) return path;
+			if (gc_tracing) gc_trace_collect(gc_trace_op::force_collect, 0);
+			gc_after_collect([&]()
+			{
+				path = gc_retention_path_unsafe(gc_find_unsafe(handle), ignored_roots);
+			});
+			return path;
+		}
+
+		void gc_relocate(enable_gc* handle, ptrdiff_t offset)
+		{
+			handle->record.start = (char*)handle->record.start + offset;
+			handle->record.handle = handle;
 		}
 	}
 
-	void gc_start(size_t step_size, size_t max_size)
+	void gc_start(const gc_options& options)
 	{
-		assert(!gc_handles);
+		assert(!gc_running);
 
 		lock_guard<mutex> guard(gc_lock);
-		gc_handles = new gc_handle_container;
-		gc_step_size = step_size;
-		gc_max_size = max_size;
+		gc_arena_start();
+		gc_marker_start(options.mark_threads);
+		gc_running = true;
+		gc_step_size = options.step_size;
+		gc_max_size = options.max_size;
+		gc_alloc_batch_size = min(options.step_size, (size_t)64 * 1024);
+		gc_incremental_budget = options.incremental_budget;
+		gc_concurrent = options.concurrent;
+		gc_nursery_size = options.nursery_size;
+		gc_promotion_age = max(1, min(options.promotion_age, 255));
 		gc_last_current_size = 0;
+		gc_growth_ratio = max(0.0, options.growth_ratio);
+		gc_cpu_budget = max(0.0, options.cpu_budget);
+		gc_counting = options.reference_counting;
+		gc_cycle_candidates = max((size_t)1, options.cycle_candidates);
+		gc_rc_candidate_limit = gc_cycle_candidates;
+		gc_paced_ratio = gc_growth_ratio;
+		gc_next_trigger = options.step_size;
+		gc_pacer_cost_ms = 0;
+		gc_pacer_start = chrono::steady_clock::now();
 		gc_current_size = 0;
+		gc_young_size = 0;
+		gc_statistics = gc_stats();
+		gc_event_callback = options.on_collection;
+		gc_pending_events.clear();
+		gc_events_pending = false;
+		gc_lock_wait_ns = 0;
+		gc_finalize_ns = 0;
+		if (options.background || options.concurrent)
+		{
+			gc_collector_start();
+		}
+		if (options.finalizer_threads > 0)
+		{
+			gc_finalizer_start(options.finalizer_threads);
+		}
+		if (!options.trace_path.empty())
+		{
+			gc_trace_start(options.trace_path);
+		}
+	}
+
+	void gc_start(size_t step_size, size_t max_size)
+	{
+		gc_options options;
+		options.step_size = step_size;
+		options.max_size = max_size;
+		gc_start(options);
 	}
 
 	void gc_stop()
 	{
-		assert(gc_handles);
+		assert(gc_running);
+		assert(gc_private_heaps == 0);
+		gc_trace_stop();
+		gc_collector_stop();
 		gc_force_collect();
+		gc_finalizer_stop();
+
+		// objects that are still alive are destroyed without the lock, their destructors release gc_ptr fields
+		vector<gc_handle*> garbages;
+		{
+			lock_guard<mutex> guard(gc_lock);
+			gc_lock_logs_unsafe();
+			gc_for_each_handle_unsafe([&](gc_handle* handle)
+			{
+				handle->state = gc_handle_state::garbage;
+				gc_weak_clear_unsafe(handle);
+				garbages.push_back(handle);
+			});
+			gc_rc_take_garbages_unsafe(garbages);
+			for (auto log : gc_ref_logs)
+			{
+				garbages.insert(garbages.end(), log->garbages.begin(), log->garbages.end());
+				log->garbages.clear();
+			}
+			gc_rc_zeros.clear();
+			gc_rc_candidates.clear();
+			gc_unlock_logs_unsafe();
+		}
+		gc_destroy_unsafe(garbages);
 
 		lock_guard<mutex> guard(gc_lock);
-		auto garbages = gc_handles;
-		gc_handles = nullptr;
+		for (auto log : gc_ref_logs)
+		{
+			lock_guard<gc_spin_lock> log_guard(log->lock);
+			log->count = 0;
+			log->allocated_size = 0;
+			log->allocated.clear();
+			log->registered = false;
+		}
+		gc_ref_logs.clear();
+		gc_nursery.clear();
+		gc_remembered.clear();
+		gc_counting = false;
+		gc_running = false;
 		gc_step_size = 0;
 		gc_max_size = 0;
+		gc_alloc_batch_size = 0;
+		gc_incremental_budget = 0;
+		gc_concurrent = false;
+		gc_nursery_size = 0;
+		gc_promotion_age = 0;
 		gc_last_current_size = 0;
+		gc_growth_ratio = 0;
+		gc_cpu_budget = 0;
 		gc_current_size = 0;
+		gc_young_size = 0;
+		gc_event_callback = nullptr;
+		gc_marker_stop();
+		gc_arena_stop();
+	}
+
+	void gc_force_collect()
+	{
+		assert(gc_running);
+		if (gc_tracing) gc_trace_collect(gc_trace_op::force_collect, 0);
+		gc_collect_all();
+	}
 
-		for (auto handle : *garbages)
+	void gc_compact(double max_occupancy)
+	{
+		if (gc_tracing) gc_trace_collect(gc_trace_op::compact, (uint64_t)(max_occupancy * 1e6));
+		gc_after_collect([&]()
 		{
-			gc_destroy_disconnect_unsafe(handle);
+			gc_compact_unsafe(max_occupancy);
+		});
+	}
+
+	gc_heap_profile gc_profile_heap()
+	{
+		if (gc_tracing) gc_trace_collect(gc_trace_op::force_collect, 0);
+		gc_heap_profile profile;
+		gc_after_collect([&]()
+		{
+			profile = gc_profile_heap_unsafe();
+		});
+		return profile;
+	}
+
+	bool gc_write_heap_profile(const char* path)
+	{
+		auto profile = gc_profile_heap();
+		FILE* file = fopen(path, "w");
+		if (!file) return false;
+
+		fprintf(file, "# objects %zu bytes %zu\n", profile.objects, profile.bytes);
+		fprintf(file, "# bytes\tcount\ttype\n");
+		for (auto& type : profile.types)
+		{
+			fprintf(file, "%zu\t%zu\t%s\n", type.bytes, type.count, type.type.c_str());
 		}
-		for (auto handle : *garbages)
+		return fclose(file) == 0;
+	}
+
+	gc_stats gc_get_stats()
+	{
+		lock_guard<mutex> guard(gc_lock);
+		auto stats = gc_statistics;
+		stats.growth_ratio = gc_paced_ratio;
+		stats.next_trigger = gc_growth_ratio > 0 ? gc_next_trigger : min(gc_max_size, gc_last_current_size + gc_step_size);
+		stats.finalize_ms = gc_finalize_ns / 1e6;
+		stats.lock_wait_ms = gc_lock_wait_ns / 1e6;
+		gc_arena_memory(stats.committed_bytes, stats.released_bytes);
+		return stats;
+	}
+
+	double gc_pause_percentile_us(const gc_stats& stats, double percentile)
+	{
+		size_t total = 0;
+		for (auto count : stats.pause_histogram) total += count;
+		if (total == 0) return 0;
+
+		// the upper bound of the bucket that contains the percentile, the longest pause is in the last bucket
+		double max_us = max(stats.major_pauses.max_ms, stats.minor_pauses.max_ms) * 1000;
+		size_t target = max((size_t)1, (size_t)ceil(total * percentile));
+		size_t seen = 0;
+		for (int i = 0; i < gc_pause_histogram_size; i++)
 		{
-			gc_destroy_unsafe(handle);
+			seen += stats.pause_histogram[i];
+			if (seen >= target) return min((double)((size_t)1 << i), max_us);
 		}
-		delete garbages;
+		return max_us;
 	}
 
-	void gc_force_collect()
+	size_t gc_collect_step(size_t budget)
 	{
-		assert(gc_handles);
-		
+		assert(gc_running);
+		if (gc_tracing) gc_trace_collect(gc_trace_op::collect_step, budget);
+
 		vector<gc_handle*> garbages;
+		size_t remaining = 0;
 		{
 			lock_guard<mutex> guard(gc_lock);
-			gc_force_collect_unsafe(garbages);
+			remaining = gc_collect_step_unsafe(budget, garbages);
 		}
 		gc_destroy_unsafe(garbages);
+		gc_report_events();
+		return remaining;
+	}
+
+	size_t gc_collect_step_for(chrono::microseconds duration)
+	{
+		assert(gc_running);
+
+		auto deadline = chrono::steady_clock::now() + duration;
+		while (true)
+		{
+			size_t remaining = gc_collect_step(gc_collect_slice);
+			if (remaining == 0 || chrono::steady_clock::now() >= deadline) return remaining;
+		}
+	}
+
+	gc_heap::gc_heap(size_t step_size)
+		:state(new gc_heap_state)
+	{
+		assert(gc_running);
+		state->step_size = step_size;
+		gc_private_heaps++;
+		if (gc_tracing) gc_trace_heap(gc_trace_op::heap_create, this, step_size);
+	}
+
+	gc_heap::~gc_heap()
+	{
+		// no root is left, every object is a garbage
+		if (gc_tracing) gc_trace_heap(gc_trace_op::heap_destroy, this, 0);
+		vector<gc_handle*> garbages;
+		state->collecting = true;
+		gc_heap_for_each_handle(state, [&](gc_handle* handle)
+		{
+			assert(handle->counter == 0);
+			handle->state = gc_handle_state::garbage;
+			gc_weak_clear_unsafe(handle);
+			garbages.push_back(handle);
+		});
+		gc_heap_destroy(state, garbages);
+		gc_space_clear(state);
+		delete state;
+		gc_private_heaps--;
+	}
+
+	void gc_heap::collect()
+	{
+		if (gc_tracing) gc_trace_heap(gc_trace_op::heap_collect, this, 0);
+		gc_heap_collect(state);
+	}
+
+	void gc_heap::discard()
+	{
+		if (gc_tracing) gc_trace_heap(gc_trace_op::heap_discard, this, 0);
+		for (auto handle : state->weak_targets)
+		{
+			gc_weak_clear_unsafe(handle);
+		}
+		state->weak_targets.clear();
+
+		// like ~gc_heap, no gc_ptr outside of the heap can still reference its objects
+		// destructors of objects are skipped, but handles are destroyed, because a large edge map owns a table
+		gc_heap_for_each_handle(state, [](gc_handle* handle)
+		{
+			assert(handle->counter == 0);
+			handle->state = gc_handle_state::free;
+			handle->~gc_handle();
+		});
+		gc_space_clear(state);
+		state->current_size = 0;
+		state->last_size = 0;
+	}
+
+	size_t gc_heap::size()const
+	{
+		return state->current_size;
 	}
-}
\ No newline at end of file
+}
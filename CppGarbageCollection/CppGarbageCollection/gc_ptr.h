@@ -1,5 +1,14 @@
 #pragma once
 #include <memory>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <type_traits>
+#include <utility>
+#include <functional>
+#include <new>
+#include <cstddef>
+#include <string>
 
 namespace vczh
 {
@@ -7,21 +16,41 @@ namespace vczh
 	class enable_gc;
 	template<typename T>
 	class gc_ptr;
+	template<typename T>
+	class gc_borrowed_ptr;
+	template<typename T>
+	class gc_array;
+	template<typename T>
+	class gc_weak_ptr;
+	class gc_heap;
+	struct gc_heap_state;
+	struct gc_weak_cell;
+	struct gc_retention_step;
 
 	struct gc_record
 	{
 		void*				start = nullptr;
-		int					length = 0;
+		size_t				length = 0;
 		enable_gc*			handle = nullptr;
 	};
 
+	namespace unsafe_functions
+	{
+		extern void gc_relocate(enable_gc* handle, std::ptrdiff_t offset);	// updates the record of an object that is copied <offset> bytes away
+	}
+
 	class enable_gc
 	{
+		friend void unsafe_functions::gc_relocate(enable_gc* handle, std::ptrdiff_t offset);
+
 		template<typename T>
 		friend class gc_ptr;
 
 		template<typename T, typename ...TArgs>
-		friend gc_ptr<T> make_gc(TArgs&& ...args);
+		friend gc_ptr<T> gc_make(gc_heap* heap, TArgs&& ...args);
+
+		template<typename T, typename ...TArgs>
+		friend gc_ptr<gc_array<T>> gc_make_array(gc_heap* heap, size_t count, const TArgs& ...args);
 	private:
 		gc_record			record;
 
@@ -31,17 +60,318 @@ namespace vczh
 		virtual ~enable_gc();
 	};
 
+	// offsets of gc_ptr members of a type, they are learned from the first object of the type
+	// for an array, they are offsets in every item, which is <stride> bytes after the previous one
+	struct gc_pointer_map
+	{
+		std::atomic<bool>	ready{ false };
+		std::vector<size_t>	offsets;
+		size_t				first = 0;					// offset of the first item
+		size_t				stride = 0;					// 0 if the object is not an array
+	};
+
 	namespace unsafe_functions
 	{
-		extern void gc_alloc(gc_record record);
+		extern void gc_alloc(gc_record& record, gc_pointer_map* pointer_map, bool relocatable, gc_heap* heap);	// <heap> is nullptr for the shared heap
+		extern void gc_learn_pointers(gc_pointer_map* pointer_map, void* memory, void* item, size_t stride, const std::vector<void*>& pointers);
 		extern void gc_register(void* reference, enable_gc* handle);
 		extern void gc_ref_alloc(void** handle_reference, void* handle);
 		extern void gc_ref_dealloc(void** handle_reference, void* handle);
 		extern void gc_ref(void** handle_reference, void* old_handle, void* new_handle);
+		extern void gc_ref_move_alloc(void** handle_reference, void** source_reference, void* handle);
+		extern void gc_ref_move(void** handle_reference, void** source_reference, void* old_handle, void* new_handle);
+		extern void gc_ref_swap(void** handle_reference, void** other_reference, void* handle, void* other_handle);
+		extern void gc_ref_adopt(void** handle_reference, void* handle);	// takes over the counter that protects a new object
+		extern void gc_pin(void* handle, bool pin);
+		extern gc_weak_cell* gc_weak_alloc(void* handle);
+		extern void gc_weak_retain(gc_weak_cell* cell);
+		extern void gc_weak_release(gc_weak_cell* cell);
+		extern bool gc_weak_expired(gc_weak_cell* cell);
+		extern std::vector<gc_retention_step> gc_retention_path(void* handle, int ignored_roots);
+		extern void* gc_weak_lock(void** handle_reference, gc_weak_cell* cell);	// returns the handle and references it from the gc_ptr, or nullptr if it is dead
+
+		// a gc_ptr in an object is read by a concurrent marker while another thread writes it, both sides access it atomically
+		inline void* gc_load_field(void* const* field)
+		{
+#ifdef _MSC_VER
+			return *reinterpret_cast<void* const volatile*>(field);
+#else
+			return __atomic_load_n(field, __ATOMIC_RELAXED);
+#endif
+		}
+
+		inline void gc_store_field(void** field, void* value)
+		{
+#ifdef _MSC_VER
+			*reinterpret_cast<void* volatile*>(field) = value;
+#else
+			__atomic_store_n(field, value, __ATOMIC_RELAXED);
+#endif
+		}
 	}
+
+	enum class gc_trigger
+	{
+		step,						// the heap grows by <step_size> since the last collection
+		max,						// the heap exceeds <max_size>
+		forced,						// gc_force_collect or gc_stop
+		nursery,					// <nursery_size> bytes are allocated since the last collection
+		paced,						// the heap grows by <growth_ratio> times the bytes alive after the last collection
+		candidates,					// trial deletion with <reference_counting>, which only looks at objects reachable from candidates of garbage cycles
+	};
+
+	// reported when a collection is finished, destructors of its garbages may still be running
+	struct gc_event
+	{
+		gc_trigger			trigger = gc_trigger::step;	// gc_trigger::nursery for a minor collection
+		double				mark_ms = 0;				// time spent marking, summed over all steps of the collection
+		double				sweep_ms = 0;				// time spent sweeping, summed over all steps of the collection
+		size_t				freed_objects = 0;
+		size_t				freed_bytes = 0;
+		size_t				live_bytes = 0;				// bytes of objects that are alive after the collection
+	};
+
+	struct gc_options
+	{
+		size_t				step_size = 0x00100000;		// collect whenever the increment of the memory exceeds <step_size> bytes
+		size_t				max_size = 0x00500000;		// collect whenever the total memory used exceeds <max_size> bytes
+		int					mark_threads = 1;			// threads that mark together in a collection including the collecting one, 0 for one per core
+		bool				background = false;			// collect on a collector thread after <step_size>, only <max_size> makes the allocating thread collect
+		bool				concurrent = false;			// the collector thread marks and sweeps in steps while other threads keep running, implies <background>
+		int					finalizer_threads = 0;		// destroy garbages in batches on a pool of threads, 0 to destroy them on the thread that sweeps them
+		size_t				incremental_budget = 0;		// after <step_size>, every log flush advances the collection by <incremental_budget> units of work, 0 to collect in one pause
+		size_t				nursery_size = 0;			// collect only young objects whenever <nursery_size> bytes are allocated, 0 to disable
+		int					promotion_age = 2;			// young objects that survive <promotion_age> minor collections become old
+		double				growth_ratio = 0;			// collect when the heap grows by <growth_ratio> times the bytes alive after the last collection and at least by <step_size>, 0 to collect by <step_size>
+															// <max_size> caps the trigger until the live heap gets close to it, then the heap grows by <step_size> between collections
+		double				cpu_budget = 0;				// with <growth_ratio>, the fraction of time collections may take, the ratio is raised while they take more, 0 for no limit
+		bool				reference_counting = false;	// free an object as soon as nothing references it, and look for garbage cycles by trial deletion instead of marking the heap
+		size_t				cycle_candidates = 4096;	// with <reference_counting>, run trial deletion when this many objects lose a reference but not the last one
+															// or when the heap grows by <step_size>, marking only runs after <max_size> or when there is no candidate
+		std::string			trace_path;					// write every gc_ptr operation and collection to this file until gc_stop, for gc_replay, empty to disable
+		std::function<void(const gc_event&)>	on_collection;	// called without any lock after every collection, by the thread that finishes it
+	};
+
+	struct gc_pause_stats
+	{
+		size_t				count = 0;					// how many times other threads are stopped
+		double				total_ms = 0;
+		double				max_ms = 0;
+	};
+
+	const int				gc_pause_histogram_size = 24;
+
+	struct gc_stats
+	{
+		size_t				minor_collections = 0;		// collections of young objects
+		size_t				major_collections = 0;		// collections of the whole heap
+		size_t				step_collections = 0;		// major collections by trigger
+		size_t				max_collections = 0;
+		size_t				forced_collections = 0;
+		size_t				paced_collections = 0;
+		gc_pause_stats		minor_pauses;
+		gc_pause_stats		major_pauses;				// a concurrent or incremental collection pauses at its beginning and at its end
+		size_t				pause_histogram[gc_pause_histogram_size] = {};	// pauses of both kinds, item i counts those in [2^(i-1), 2^i) microseconds
+		double				mark_ms = 0;
+		double				sweep_ms = 0;
+		double				finalize_ms = 0;			// time spent in destructors and returning memory, summed over all threads
+		size_t				freed_objects = 0;
+		size_t				freed_bytes = 0;
+		size_t				live_bytes = 0;				// after the last finished collection
+		double				lock_wait_ms = 0;			// time gc_ptr operations wait for locks that the collector holds, summed over all threads
+		size_t				compactions = 0;
+		size_t				moved_objects = 0;
+		size_t				moved_bytes = 0;
+		double				compact_ms = 0;
+		double				growth_ratio = 0;			// the ratio that the pacer is using, it is at least gc_options::growth_ratio
+		size_t				next_trigger = 0;			// the heap size that starts the next major collection
+		size_t				committed_bytes = 0;		// memory of pages that are in use or kept for reuse, which counts toward the RSS
+		size_t				released_bytes = 0;			// memory of empty pages given back to the system
+		size_t				counted_objects = 0;		// freed with gc_options::reference_counting when their counts drop to zero
+		size_t				counted_bytes = 0;
+		size_t				cycle_collections = 0;		// trial deletions, they are reported as collections but not counted in <major_collections>
+	};
+
+	extern void gc_start(const gc_options& options);
 	extern void gc_start(size_t step_size, size_t max_size);
 	extern void gc_stop();
 	extern void gc_force_collect();
+	extern gc_stats gc_get_stats();
+	extern double gc_pause_percentile_us(const gc_stats& stats, double percentile);	// estimated from <pause_histogram>, never above the longest pause
+
+	// advance the running collection by <budget> units of work, or for <duration>, and return the work left in it
+	// a collection is started only if it is necessary, and 0 is returned when there is nothing to do
+	extern size_t gc_collect_step(size_t budget);
+	extern size_t gc_collect_step_for(std::chrono::microseconds duration);
+
+	struct gc_type_stats
+	{
+		std::string			type;						// the dynamic type of objects
+		size_t				count = 0;
+		size_t				bytes = 0;
+	};
+
+	struct gc_heap_profile
+	{
+		size_t				objects = 0;
+		size_t				bytes = 0;
+		std::vector<gc_type_stats>	types;				// sorted by type, so that two profiles can be diffed
+	};
+
+	// an object on the shortest path from a rooted object to the chosen one
+	struct gc_retention_step
+	{
+		std::string			type;
+		const void*			object = nullptr;			// the start of the object
+		size_t				bytes = 0;
+	};
+
+	struct gc_replay_stats
+	{
+		size_t				events = 0;					// records that are replayed
+		size_t				threads = 0;				// threads that made the records
+		size_t				collections = 0;			// collections in the trace, to compare with those of the replay
+		size_t				diverged = 0;				// objects that gc_weak_ptr locked in the trace but the replay has already collected
+	};
+
+	// drive the started collector with a trace written with gc_options::trace_path, returns false if the file is not a trace
+	// with <threads> every recorded thread is replayed by a thread of its own, taking turns in the recorded order
+	// otherwise all records are replayed by the calling thread
+	extern bool gc_replay(const char* path, bool threads, gc_replay_stats& stats);
+
+	// collect, then count live objects and bytes by type
+	extern gc_heap_profile gc_profile_heap();
+	// write gc_profile_heap() to a text file, one type per line
+	extern bool gc_write_heap_profile(const char* path);
+
+	// collect, then move relocatable objects out of small pages whose slots are not used more than <max_occupancy>
+	// no other thread can use gc_ptr or any object of the collector until it returns
+	extern void gc_compact(double max_occupancy = 0.5);
+
+	//////////////////////////////////////////////////////////////////
+	// pointer maps
+	//
+	// A type that lists all of its gc_ptr members with GC_POINTERS,
+	// including those inherited from base classes, is scanned by the
+	// marker directly. Its gc_ptr members are not registered when they
+	// are constructed or destroyed. GC_POINTERS must be declared again in
+	// every derived class, otherwise the derived class is not precise.
+	// The layout is learned from the first object of the type, and debug
+	// builds assert that GC_POINTERS lists every gc_ptr member that
+	// registered itself while that object was constructed.
+	//////////////////////////////////////////////////////////////////
+
+	inline void gc_add_pointers(std::vector<void*>&)
+	{
+	}
+
+	template<typename T, typename ...TArgs>
+	void gc_add_pointers(std::vector<void*>& pointers, gc_ptr<T>& field, TArgs& ...fields)
+	{
+		pointers.push_back(&field);
+		gc_add_pointers(pointers, fields...);
+	}
+
+	template<typename T, size_t N, typename ...TArgs>
+	void gc_add_pointers(std::vector<void*>& pointers, gc_ptr<T>(&field)[N], TArgs& ...fields)
+	{
+		for (auto& item : field)
+		{
+			pointers.push_back(&item);
+		}
+		gc_add_pointers(pointers, fields...);
+	}
+
+	template<typename T, typename = void>
+	struct gc_pointer_map_of
+	{
+		static gc_pointer_map* get()
+		{
+			return nullptr;
+		}
+
+		static gc_pointer_map* get_array()
+		{
+			return nullptr;
+		}
+
+		static void learn(T*, void*)
+		{
+		}
+
+		static void learn_array(T*, void*)
+		{
+		}
+	};
+
+	template<typename T>
+	struct gc_pointer_map_of<T, typename std::enable_if<std::is_same<decltype(&T::gc_pointers), void(T::*)(std::vector<void*>&)>::value>::type>
+	{
+		static gc_pointer_map* get()
+		{
+			static gc_pointer_map pointer_map;
+			return &pointer_map;
+		}
+
+		static gc_pointer_map* get_array()
+		{
+			static gc_pointer_map pointer_map;
+			return &pointer_map;
+		}
+
+		static void learn(T* reference, void* memory)
+		{
+			std::vector<void*> pointers;
+			reference->gc_pointers(pointers);
+			unsafe_functions::gc_learn_pointers(get(), memory, memory, 0, pointers);
+		}
+
+		static void learn_array(T* item, void* memory)
+		{
+			std::vector<void*> pointers;
+			item->gc_pointers(pointers);
+			unsafe_functions::gc_learn_pointers(get_array(), memory, item, sizeof(T), pointers);
+		}
+	};
+
+#define GC_POINTERS(...)\
+	public:\
+		void gc_pointers(::std::vector<void*>& pointers) { ::vczh::gc_add_pointers(pointers, __VA_ARGS__); }\
+
+	//////////////////////////////////////////////////////////////////
+	// relocatable types
+	//
+	// gc_compact only moves objects of types declared with GC_RELOCATABLE,
+	// which are still valid after being copied byte by byte to another
+	// address. gc_ptr members are patched by the compactor. An object is
+	// never moved while a gc_ptr outside of the heap points to it, pin it
+	// with gc_pin if only a raw pointer, a reference or a gc_borrowed_ptr
+	// to it is kept across gc_compact. Like GC_POINTERS, GC_RELOCATABLE
+	// must be declared again in every derived class.
+	//////////////////////////////////////////////////////////////////
+
+	template<typename T, typename = void>
+	struct gc_relocatable_of
+	{
+		static const bool value = false;
+	};
+
+	template<typename T>
+	struct gc_relocatable_of<T, typename std::enable_if<std::is_same<decltype(&T::gc_relocatable), void(T::*)()>::value>::type>
+	{
+		static const bool value = true;
+	};
+
+	// items of gc_array
+	template<typename T>
+	struct gc_relocatable_of<gc_ptr<T>>
+	{
+		static const bool value = true;
+	};
+
+#define GC_RELOCATABLE\
+	public:\
+		void gc_relocatable() {}\
 
 	template<typename T>
 	class gc_ptr
@@ -49,54 +379,82 @@ namespace vczh
 		template<typename T2>
 		friend class gc_ptr;
 
+		template<typename T2>
+		friend class gc_weak_ptr;
+
 		template<typename T2, typename ...TArgs>
-		friend gc_ptr<T2> make_gc(TArgs&& ...args);
+		friend gc_ptr<T2> gc_make(gc_heap* heap, TArgs&& ...args);
+
+		template<typename T2, typename ...TArgs>
+		friend gc_ptr<gc_array<T2>> gc_make_array(gc_heap* heap, size_t count, const TArgs& ...args);
 
 		template<typename T2, typename U>
 		friend gc_ptr<T2> static_gc_cast(const gc_ptr<U>& ptr);
 
 		template<typename T2, typename U>
 		friend gc_ptr<T2> dynamic_gc_cast(const gc_ptr<U>& ptr);
+
+		template<typename T2>
+		friend void gc_pin(const gc_ptr<T2>& ptr);
+
+		template<typename T2>
+		friend void gc_unpin(const gc_ptr<T2>& ptr);
+
+		template<typename T2>
+		friend std::vector<gc_retention_step> gc_retention_path(const gc_ptr<T2>& ptr);
 	private:
-		T*					reference = nullptr;
+		T*					reference;		// written with set(), a concurrent marker may be reading it
 
 		static void* handle_of(T* reference)
 		{
 			return reference ? static_cast<enable_gc*>(reference)->record.start : nullptr;
 		}
 
+		void set(T* value)
+		{
+			unsafe_functions::gc_store_field(reinterpret_cast<void**>(&reference), value);
+		}
+
 		gc_ptr(T* _reference)
-			:reference(_reference)
 		{
+			set(_reference);
 			unsafe_functions::gc_ref_alloc((void**)this, handle_of(reference));
 		}
 	public:
 		gc_ptr()
 		{
+			set(nullptr);
 			unsafe_functions::gc_ref_alloc((void**)this, nullptr);
 		}
 
 		gc_ptr(const gc_ptr<T>& ptr)
-			:reference(ptr.reference)
 		{
+			set(ptr.reference);
 			unsafe_functions::gc_ref_alloc((void**)this, handle_of(reference));
 		}
 
-		gc_ptr(gc_ptr<T>&& ptr)
-			:reference(ptr.reference)
+		// moving between two roots does not change any counter, so nothing is logged
+		gc_ptr(gc_ptr<T>&& ptr)noexcept
 		{
-			unsafe_functions::gc_ref_alloc((void**)this, handle_of(reference));
-			ptr.reference = nullptr;
-			unsafe_functions::gc_ref((void**)&ptr, handle_of(reference), nullptr);
+			set(ptr.reference);
+			unsafe_functions::gc_ref_move_alloc((void**)this, (void**)&ptr, handle_of(reference));
+			ptr.set(nullptr);
 		}
 
 		template<typename U>
 		gc_ptr(const gc_ptr<U>& ptr)
-			:reference(ptr.reference)
 		{
+			set(ptr.reference);
 			unsafe_functions::gc_ref_alloc((void**)this, handle_of(reference));
 		}
 
+		// roots the object again
+		template<typename U>
+		gc_ptr(const gc_borrowed_ptr<U>& ptr)
+			:gc_ptr(static_cast<T*>(ptr.get()))
+		{
+		}
+
 		~gc_ptr()
 		{
 			unsafe_functions::gc_ref_dealloc((void**)this, handle_of(reference));
@@ -107,41 +465,432 @@ namespace vczh
 			return reference != nullptr;
 		}
 
+		// the change is recorded before the field is written, so a marker scanning the field never misses the old target
 		gc_ptr<T>& operator=(const gc_ptr<T>& ptr)
 		{
 			void* old_handle = handle_of(reference);
-			reference = ptr.reference;
-			void* new_handle = handle_of(reference);
+			void* new_handle = handle_of(ptr.reference);
 			unsafe_functions::gc_ref((void**)this, old_handle, new_handle);
+			set(ptr.reference);
+			return *this;
+		}
+
+		gc_ptr<T>& operator=(gc_ptr<T>&& ptr)noexcept
+		{
+			if (this != &ptr)
+			{
+				unsafe_functions::gc_ref_move((void**)this, (void**)&ptr, handle_of(reference), handle_of(ptr.reference));
+				set(ptr.reference);
+				ptr.set(nullptr);
+			}
 			return *this;
 		}
 
-		T* operator->()
+		void swap(gc_ptr<T>& ptr)noexcept
+		{
+			if (this != &ptr)
+			{
+				unsafe_functions::gc_ref_swap((void**)this, (void**)&ptr, handle_of(reference), handle_of(ptr.reference));
+				T* other = ptr.reference;
+				ptr.set(reference);
+				set(other);
+			}
+		}
+
+		void reset()
+		{
+			if (reference)
+			{
+				unsafe_functions::gc_ref((void**)this, handle_of(reference), nullptr);
+				set(nullptr);
+			}
+		}
+
+		T* operator->()const
+		{
+			return reference;
+		}
+
+		T& operator*()const
+		{
+			return *reference;
+		}
+
+		T* get()const
 		{
 			return reference;
 		}
 	};
 
+	//////////////////////////////////////////////////////////////////
+	// gc_borrowed_ptr
+	//
+	// A borrowed pointer does not keep its object alive, so copying it
+	// is as cheap as copying a raw pointer. It is for parameters and
+	// local variables that only use objects that gc_ptr keeps alive, like
+	// a loop variable walking a list. Convert it back to gc_ptr to store
+	// it or to keep the object after its owners let it go.
+	//////////////////////////////////////////////////////////////////
+
+	template<typename T>
+	class gc_borrowed_ptr
+	{
+	private:
+		T*					reference = nullptr;
+	public:
+		gc_borrowed_ptr()
+		{
+		}
+
+		template<typename U>
+		gc_borrowed_ptr(const gc_ptr<U>& ptr)
+			:reference(ptr.get())
+		{
+		}
+
+		template<typename U>
+		gc_borrowed_ptr(const gc_borrowed_ptr<U>& ptr)
+			:reference(ptr.get())
+		{
+		}
+
+		operator bool()const
+		{
+			return reference != nullptr;
+		}
+
+		T* operator->()const
+		{
+			return reference;
+		}
+
+		T& operator*()const
+		{
+			return *reference;
+		}
+
+		T* get()const
+		{
+			return reference;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// gc_weak_ptr
+	//
+	// A weak pointer does not keep its object alive, the marker never
+	// sees it. All weak pointers to an object share one cell, which the
+	// collector clears when it sweeps the object, so copying a weak
+	// pointer only changes a counter. lock() returns a gc_ptr to the
+	// object if it is still alive, otherwise an empty one.
+	//////////////////////////////////////////////////////////////////
+
+	template<typename T>
+	class gc_weak_ptr
+	{
+	private:
+		gc_weak_cell*		cell = nullptr;
+		std::ptrdiff_t		offset = 0;					// from the handle to the T part of the object, which stays the same when the object is moved
+	public:
+		gc_weak_ptr()
+		{
+		}
+
+		template<typename U>
+		gc_weak_ptr(const gc_ptr<U>& ptr)
+		{
+			if (T* reference = ptr.reference)
+			{
+				void* handle = gc_ptr<U>::handle_of(ptr.reference);
+				cell = unsafe_functions::gc_weak_alloc(handle);
+				offset = (char*)reference - (char*)handle;
+			}
+		}
+
+		gc_weak_ptr(const gc_weak_ptr<T>& ptr)
+			:cell(ptr.cell)
+			, offset(ptr.offset)
+		{
+			if (cell) unsafe_functions::gc_weak_retain(cell);
+		}
+
+		gc_weak_ptr(gc_weak_ptr<T>&& ptr)noexcept
+			:cell(ptr.cell)
+			, offset(ptr.offset)
+		{
+			ptr.cell = nullptr;
+		}
+
+		~gc_weak_ptr()
+		{
+			if (cell) unsafe_functions::gc_weak_release(cell);
+		}
+
+		gc_weak_ptr<T>& operator=(const gc_weak_ptr<T>& ptr)
+		{
+			gc_weak_ptr<T>(ptr).swap(*this);
+			return *this;
+		}
+
+		gc_weak_ptr<T>& operator=(gc_weak_ptr<T>&& ptr)noexcept
+		{
+			gc_weak_ptr<T>(std::move(ptr)).swap(*this);
+			return *this;
+		}
+
+		void swap(gc_weak_ptr<T>& ptr)noexcept
+		{
+			std::swap(cell, ptr.cell);
+			std::swap(offset, ptr.offset);
+		}
+
+		void reset()
+		{
+			gc_weak_ptr<T>().swap(*this);
+		}
+
+		// an object that the running collection has found dead is expired after it is swept, but it can no longer be locked
+		bool expired()const
+		{
+			return !cell || unsafe_functions::gc_weak_expired(cell);
+		}
+
+		gc_ptr<T> lock()const
+		{
+			gc_ptr<T> ptr;
+			if (cell)
+			{
+				if (void* handle = unsafe_functions::gc_weak_lock((void**)&ptr, cell))
+				{
+					ptr.set(reinterpret_cast<T*>((char*)handle + offset));
+				}
+			}
+			return ptr;
+		}
+	};
+
+	//////////////////////////////////////////////////////////////////
+	// gc_heap
+	//
+	// Objects made by make_gc(heap, args...) live in a private heap that
+	// only one thread uses. Its pages are not walked by the shared
+	// collector, and gc_ptr operations on its objects are applied at once
+	// without logs or locks. It is collected by itself, when <step_size>
+	// bytes are allocated in it or when collect() is called. Its objects
+	// may reference each other, and gc_ptr that are not in any object may
+	// reference them, but objects in different heaps cannot reference
+	// each other, a gc_ptr in an object that is assigned an object in
+	// another heap stops the program. A heap must be destroyed before
+	// gc_stop.
+	//////////////////////////////////////////////////////////////////
+
+	class gc_heap
+	{
+		friend void unsafe_functions::gc_alloc(gc_record& record, gc_pointer_map* pointer_map, bool relocatable, gc_heap* heap);
+	private:
+		gc_heap_state*		state;
+	public:
+		explicit gc_heap(size_t step_size = 0x00100000);
+		gc_heap(const gc_heap&) = delete;
+		gc_heap& operator=(const gc_heap&) = delete;
+		~gc_heap();							// destroys every object, no gc_ptr outside of the heap can still reference them
+
+		void				collect();
+		void				discard();		// frees every page without running destructors, for objects that own nothing outside of the heap
+		size_t				size()const;	// bytes of objects that are allocated
+	};
+
+	// a precise object is zeroed by gc_alloc and a concurrent marker may scan it before it is constructed,
+	// so it is not zeroed again by value-initialization when it is made without arguments
+	template<typename T>
+	T* gc_construct(void* memory, bool zeroed)
+	{
+		return zeroed ? new(memory)T : new(memory)T();
+	}
+
 	template<typename T, typename ...TArgs>
-	gc_ptr<T> make_gc(TArgs&& ...args)
+	T* gc_construct(void* memory, bool, TArgs&& ...args)
+	{
+		return new(memory)T(std::forward<TArgs>(args)...);
+	}
+
+	template<typename T, typename ...TArgs>
+	gc_ptr<T> gc_make(gc_heap* heap, TArgs&& ...args)
 	{
-		void* memory = malloc(sizeof(T));
+		// the first object of a precise type registers its gc_ptr members, and its layout is learned from it
+		auto pointer_map = gc_pointer_map_of<T>::get();
+		bool precise = pointer_map && pointer_map->ready.load(std::memory_order_acquire);
+
 		gc_record record;
-		record.start = memory;
 		record.length = sizeof(T);
-		unsafe_functions::gc_alloc(record);
+		unsafe_functions::gc_alloc(record, precise ? pointer_map : nullptr, gc_relocatable_of<T>::value, heap);
+		void* memory = record.start;
 
-		T* reference = new(memory)T(std::forward<TArgs>(args)...);
+		T* reference = gc_construct<T>(memory, precise, std::forward<TArgs>(args)...);
+		if (pointer_map && !precise)
+		{
+			gc_pointer_map_of<T>::learn(reference, memory);
+		}
 		enable_gc* e = static_cast<enable_gc*>(reference);
 		record.handle = e;
 		e->set_record(record);
 		unsafe_functions::gc_register(memory, e);
 
-		auto ptr = gc_ptr<T>(reference);
-		unsafe_functions::gc_ref(nullptr, memory, nullptr);
+		// the returned gc_ptr takes over the counter that protects the new object
+		gc_ptr<T> ptr;
+		ptr.set(reference);
+		unsafe_functions::gc_ref_adopt((void**)&ptr, memory);
 		return ptr;
 	}
 
+	template<typename T, typename ...TArgs>
+	gc_ptr<T> make_gc(TArgs&& ...args)
+	{
+		return gc_make<T>(nullptr, std::forward<TArgs>(args)...);
+	}
+
+	template<typename T, typename ...TArgs>
+	gc_ptr<T> make_gc(gc_heap& heap, TArgs&& ...args)
+	{
+		return gc_make<T>(&heap, std::forward<TArgs>(args)...);
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// gc_array
+	//
+	// make_gc_array<T>(count, args...) stores <count> items in one object
+	// with one handle, every item is constructed with <args>. Items are
+	// not objects of the collector, a reference to an item is valid as
+	// long as the array is alive. If T lists its gc_ptr members with
+	// GC_POINTERS, they are scanned as one block. gc_compact may move the
+	// array if T is trivially copyable or declared with GC_RELOCATABLE.
+	//////////////////////////////////////////////////////////////////
+
+	template<typename T>
+	class gc_array : public virtual enable_gc
+	{
+		template<typename T2, typename ...TArgs>
+		friend gc_ptr<gc_array<T2>> gc_make_array(gc_heap* heap, size_t count, const TArgs& ...args);
+	private:
+		size_t				count = 0;
+
+		static size_t items_offset()
+		{
+			return (sizeof(gc_array<T>) + alignof(T) - 1) / alignof(T) * alignof(T);
+		}
+
+		template<typename ...TArgs>
+		gc_array(size_t _count, bool zeroed, const TArgs& ...args)
+		{
+			for (; count < _count; count++)
+			{
+				gc_construct<T>(begin() + count, zeroed, args...);
+			}
+		}
+	public:
+		~gc_array()
+		{
+			while (count > 0)
+			{
+				begin()[--count].~T();
+			}
+		}
+
+		size_t size()const
+		{
+			return count;
+		}
+
+		T* begin()
+		{
+			return reinterpret_cast<T*>((char*)this + items_offset());
+		}
+
+		T* end()
+		{
+			return begin() + count;
+		}
+
+		T& operator[](size_t index)
+		{
+			return begin()[index];
+		}
+	};
+
+	template<typename T, typename ...TArgs>
+	gc_ptr<gc_array<T>> gc_make_array(gc_heap* heap, size_t count, const TArgs& ...args)
+	{
+		static_assert(alignof(T) <= alignof(std::max_align_t), "items of gc_array cannot be over-aligned");
+		auto pointer_map = gc_pointer_map_of<T>::get_array();
+		bool precise = pointer_map && pointer_map->ready.load(std::memory_order_acquire);
+
+		gc_record record;
+		record.length = gc_array<T>::items_offset() + sizeof(T) * count;
+		bool relocatable = std::is_trivially_copyable<T>::value || gc_relocatable_of<T>::value;
+		unsafe_functions::gc_alloc(record, precise ? pointer_map : nullptr, relocatable, heap);
+		void* memory = record.start;
+
+		auto reference = new(memory)gc_array<T>(count, precise, args...);
+		if (pointer_map && !precise && count > 0)
+		{
+			gc_pointer_map_of<T>::learn_array(reference->begin(), memory);
+		}
+		enable_gc* e = static_cast<enable_gc*>(reference);
+		record.handle = e;
+		e->set_record(record);
+		unsafe_functions::gc_register(memory, e);
+
+		gc_ptr<gc_array<T>> ptr;
+		ptr.set(reference);
+		unsafe_functions::gc_ref_adopt((void**)&ptr, memory);
+		return ptr;
+	}
+
+	template<typename T, typename ...TArgs>
+	gc_ptr<gc_array<T>> make_gc_array(size_t count, const TArgs& ...args)
+	{
+		return gc_make_array<T>(nullptr, count, args...);
+	}
+
+	template<typename T, typename ...TArgs>
+	gc_ptr<gc_array<T>> make_gc_array(gc_heap& heap, size_t count, const TArgs& ...args)
+	{
+		return gc_make_array<T>(&heap, count, args...);
+	}
+
+	template<typename T>
+	void swap(gc_ptr<T>& a, gc_ptr<T>& b)noexcept
+	{
+		a.swap(b);
+	}
+
+	template<typename T>
+	void swap(gc_weak_ptr<T>& a, gc_weak_ptr<T>& b)noexcept
+	{
+		a.swap(b);
+	}
+
+	// keeps gc_compact from moving the object, until it is unpinned as many times
+	template<typename T>
+	void gc_pin(const gc_ptr<T>& ptr)
+	{
+		unsafe_functions::gc_pin(gc_ptr<T>::handle_of(ptr.reference), true);
+	}
+
+	template<typename T>
+	void gc_unpin(const gc_ptr<T>& ptr)
+	{
+		unsafe_functions::gc_pin(gc_ptr<T>::handle_of(ptr.reference), false);
+	}
+
+	// collect, then return the shortest path from a rooted object to the object, which is empty if only <ptr> keeps it alive
+	// the path starts from the object itself if another gc_ptr outside of the heap points to it
+	template<typename T>
+	std::vector<gc_retention_step> gc_retention_path(const gc_ptr<T>& ptr)
+	{
+		return unsafe_functions::gc_retention_path(gc_ptr<T>::handle_of(ptr.reference), 1);
+	}
+
 	template<typename T, typename U>
 	gc_ptr<T> static_gc_cast(const gc_ptr<U>& ptr)
 	{
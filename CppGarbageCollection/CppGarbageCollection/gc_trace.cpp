@@ -0,0 +1,819 @@
+#include "gc_internal.h"
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+namespace vczh
+{
+	//////////////////////////////////////////////////////////////////
+	// trace recorder
+	//////////////////////////////////////////////////////////////////
+
+	const char							gc_trace_magic[8] = { 'G', 'C', 'T', 'R', 'A', 'C', 'E', '1' };
+	const size_t						gc_trace_flush_size = 0x00100000;
+
+	enum gc_trace_kind
+	{
+		gc_trace_objects,				// starts of objects
+		gc_trace_roots,					// gc_ptr outside of objects
+		gc_trace_others,				// pointer maps, weak cells and heaps
+		gc_trace_kinds,
+	};
+
+	struct gc_trace_writer
+	{
+		mutex							lock;
+		FILE*							file = nullptr;
+		vector<unsigned char>			buffer;
+		int								session = 0;		// threads are numbered again after every gc_start
+		int								threads = 0;
+		int								last_thread = -1;
+		uint64_t						last[gc_trace_kinds] = {};
+	};
+
+	bool								gc_tracing = false;
+	gc_trace_writer						gc_trace;
+	thread_local int					gc_trace_thread_session = 0;
+	thread_local int					gc_trace_thread = 0;
+
+	void gc_trace_put_unsafe(uint64_t value)
+	{
+		while (value >= 0x80)
+		{
+			gc_trace.buffer.push_back((unsigned char)(value | 0x80));
+			value >>= 7;
+		}
+		gc_trace.buffer.push_back((unsigned char)value);
+	}
+
+	void gc_trace_put_address_unsafe(gc_trace_kind kind, const void* address)
+	{
+		if (!address)
+		{
+			gc_trace_put_unsafe(0);
+			return;
+		}
+		auto value = (uint64_t)(uintptr_t)address;
+		auto delta = (int64_t)(value - gc_trace.last[kind]);
+		gc_trace_put_unsafe((((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63)) + 1);
+		gc_trace.last[kind] = value;
+	}
+
+	void gc_trace_put_reference_unsafe(void** handle_reference, gc_handle* parent)
+	{
+		if (parent)
+		{
+			gc_trace_put_address_unsafe(gc_trace_objects, parent->record.start);
+			gc_trace_put_unsafe((uint64_t)((char*)handle_reference - (char*)parent->record.start));
+		}
+		else
+		{
+			gc_trace_put_address_unsafe(gc_trace_objects, nullptr);
+			gc_trace_put_address_unsafe(gc_trace_roots, handle_reference);
+		}
+	}
+
+	void gc_trace_flush_unsafe()
+	{
+		if (gc_trace.buffer.size() > 0)
+		{
+			fwrite(gc_trace.buffer.data(), 1, gc_trace.buffer.size(), gc_trace.file);
+			gc_trace.buffer.clear();
+		}
+	}
+
+	// requires gc_trace.lock, returns false if the trace is stopped, records of the collector do not belong to any thread
+	bool gc_trace_begin_unsafe(gc_trace_op op, bool threaded = true)
+	{
+		if (!gc_tracing) return false;
+		if (threaded)
+		{
+			if (gc_trace_thread_session != gc_trace.session)
+			{
+				gc_trace_thread_session = gc_trace.session;
+				gc_trace_thread = gc_trace.threads++;
+			}
+			if (gc_trace.last_thread != gc_trace_thread)
+			{
+				gc_trace.last_thread = gc_trace_thread;
+				gc_trace.buffer.push_back((unsigned char)gc_trace_op::thread);
+				gc_trace_put_unsafe((uint64_t)gc_trace_thread);
+			}
+		}
+		gc_trace.buffer.push_back((unsigned char)op);
+		return true;
+	}
+
+	void gc_trace_end_unsafe()
+	{
+		if (gc_trace.buffer.size() >= gc_trace_flush_size)
+		{
+			gc_trace_flush_unsafe();
+		}
+	}
+
+	// returns the handle if it is an object that is alive, a destructor may still pass a garbage
+	void* gc_trace_target(void* handle)
+	{
+		return gc_find_unsafe(handle) ? handle : nullptr;
+	}
+
+	bool gc_trace_is_garbage(gc_handle* parent)
+	{
+		return parent && parent->state != gc_handle_state::allocated;
+	}
+
+	void gc_trace_start(const string& path)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		gc_trace.file = fopen(path.c_str(), "wb");
+		if (!gc_trace.file) return;
+
+		fwrite(gc_trace_magic, 1, sizeof(gc_trace_magic), gc_trace.file);
+		gc_trace.session++;
+		gc_trace.threads = 0;
+		gc_trace.last_thread = -1;
+		memset(gc_trace.last, 0, sizeof(gc_trace.last));
+		gc_tracing = true;
+	}
+
+	void gc_trace_stop()
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_tracing) return;
+
+		gc_tracing = false;
+		gc_trace_flush_unsafe();
+		fclose(gc_trace.file);
+		gc_trace.file = nullptr;
+		vector<unsigned char>().swap(gc_trace.buffer);
+	}
+
+	void gc_trace_alloc(const gc_record& record, gc_pointer_map* pointer_map, bool relocatable, gc_heap* heap)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(gc_trace_op::alloc)) return;
+		gc_trace_put_address_unsafe(gc_trace_objects, record.start);
+		gc_trace_put_unsafe(record.length);
+		gc_trace_put_address_unsafe(gc_trace_others, pointer_map);
+		gc_trace_put_unsafe(relocatable ? 1 : 0);
+		gc_trace_put_address_unsafe(gc_trace_others, heap);
+		gc_trace_end_unsafe();
+	}
+
+	void gc_trace_learn(gc_pointer_map* pointer_map)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(gc_trace_op::learn)) return;
+		gc_trace_put_address_unsafe(gc_trace_others, pointer_map);
+		gc_trace_put_unsafe(pointer_map->first);
+		gc_trace_put_unsafe(pointer_map->stride);
+		gc_trace_put_unsafe(pointer_map->offsets.size());
+		for (auto offset : pointer_map->offsets)
+		{
+			gc_trace_put_unsafe(offset);
+		}
+		gc_trace_end_unsafe();
+	}
+
+	void gc_trace_attach(void* handle, enable_gc* e)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(gc_trace_op::attach)) return;
+		gc_trace_put_address_unsafe(gc_trace_objects, handle);
+		gc_trace_put_unsafe((uint64_t)((char*)e - (char*)handle));
+		gc_trace_end_unsafe();
+	}
+
+	// <other_reference> is the second gc_ptr of move_alloc, move and swap, <other_handle> is what it references before a swap
+	void gc_trace_ref(gc_trace_op op, void** handle_reference, void** other_reference, void* handle, void* other_handle)
+	{
+		auto parent = gc_find_parent_unsafe(handle_reference);
+		auto other_parent = other_reference ? gc_find_parent_unsafe(other_reference) : nullptr;
+		bool dead = gc_trace_is_garbage(parent);
+		bool other_dead = gc_trace_is_garbage(other_parent);
+		if (dead && (!other_reference || other_dead)) return;
+
+		if (dead)
+		{
+			// only the other gc_ptr is left, it is assigned what it gets from the garbage
+			handle = op == gc_trace_op::swap ? handle : nullptr;
+			op = gc_trace_op::ref;
+			handle_reference = other_reference;
+			parent = other_parent;
+			other_reference = nullptr;
+		}
+		else if (other_dead)
+		{
+			handle = op == gc_trace_op::swap ? other_handle : handle;
+			op = op == gc_trace_op::move_alloc ? gc_trace_op::ref_alloc : gc_trace_op::ref;
+			other_reference = nullptr;
+		}
+
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(op)) return;
+		gc_trace_put_reference_unsafe(handle_reference, parent);
+		switch (op)
+		{
+		case gc_trace_op::ref_alloc:
+		case gc_trace_op::ref:
+		case gc_trace_op::adopt:
+			gc_trace_put_address_unsafe(gc_trace_objects, gc_trace_target(handle));
+			break;
+		case gc_trace_op::move_alloc:
+		case gc_trace_op::move:
+		case gc_trace_op::swap:
+			gc_trace_put_reference_unsafe(other_reference, other_parent);
+			break;
+		default:;
+		}
+		gc_trace_end_unsafe();
+	}
+
+	// pin, unpin and weak_alloc, which also records the cell
+	void gc_trace_object(gc_trace_op op, void* handle, const void* cell)
+	{
+		if (!gc_trace_target(handle)) return;
+
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(op)) return;
+		gc_trace_put_address_unsafe(gc_trace_objects, handle);
+		if (op == gc_trace_op::weak_alloc)
+		{
+			gc_trace_put_address_unsafe(gc_trace_others, cell);
+		}
+		gc_trace_end_unsafe();
+	}
+
+	// weak_retain, weak_release and weak_lock, which also records the gc_ptr
+	void gc_trace_weak(gc_trace_op op, gc_weak_cell* cell, void** handle_reference, bool locked)
+	{
+		gc_handle* parent = nullptr;
+		if (op == gc_trace_op::weak_lock)
+		{
+			parent = gc_find_parent_unsafe(handle_reference);
+			if (gc_trace_is_garbage(parent)) return;
+		}
+
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(op)) return;
+		if (op == gc_trace_op::weak_lock)
+		{
+			gc_trace_put_reference_unsafe(handle_reference, parent);
+		}
+		gc_trace_put_address_unsafe(gc_trace_others, cell);
+		if (op == gc_trace_op::weak_lock)
+		{
+			gc_trace_put_unsafe(locked ? 1 : 0);
+		}
+		gc_trace_end_unsafe();
+	}
+
+	void gc_trace_heap(gc_trace_op op, gc_heap* heap, size_t step_size)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(op)) return;
+		gc_trace_put_address_unsafe(gc_trace_others, heap);
+		if (op == gc_trace_op::heap_create)
+		{
+			gc_trace_put_unsafe(step_size);
+		}
+		gc_trace_end_unsafe();
+	}
+
+	// force_collect, collect_step and compact
+	void gc_trace_collect(gc_trace_op op, uint64_t value)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(op)) return;
+		if (op != gc_trace_op::force_collect)
+		{
+			gc_trace_put_unsafe(value);
+		}
+		gc_trace_end_unsafe();
+	}
+
+	void gc_trace_collection_unsafe(const gc_event& event)
+	{
+		lock_guard<mutex> guard(gc_trace.lock);
+		if (!gc_trace_begin_unsafe(gc_trace_op::collection, false)) return;
+		gc_trace_put_unsafe((uint64_t)event.trigger);
+		gc_trace_put_unsafe(event.freed_objects);
+		gc_trace_put_unsafe(event.freed_bytes);
+		gc_trace_put_unsafe(event.live_bytes);
+		gc_trace_end_unsafe();
+	}
+
+	//////////////////////////////////////////////////////////////////
+	// trace replay
+	//
+	// Objects are allocated with the lengths, pointer maps and heaps in
+	// the trace, and an empty enable_gc is constructed where the recorded
+	// one was, so gc_ptr are at the same offsets and destructors do
+	// nothing. Objects and gc_ptr outside of objects are found by their
+	// recorded addresses, which are followed through gc_compact in both
+	// runs. A gc_ptr in the replay stores the start of its object, and
+	// operations read what they replace from it instead of the trace.
+	// An object that the trace locks from a gc_weak_ptr could already be
+	// collected, when collections run at other moments than in the
+	// recorded run, then it is forgotten and read as nullptr afterwards.
+	//////////////////////////////////////////////////////////////////
+
+	class gc_replay_object : public enable_gc
+	{
+	};
+
+	struct gc_replay_reader
+	{
+		FILE*							file = nullptr;
+		unsigned char					buffer[0x00010000];
+		size_t							size = 0;
+		size_t							position = 0;
+		bool							failed = false;
+		uint64_t						last[gc_trace_kinds] = {};
+
+		// returns -1 at the end of the file
+		int next()
+		{
+			if (position == size)
+			{
+				size = fread(buffer, 1, sizeof(buffer), file);
+				position = 0;
+				if (size == 0) return -1;
+			}
+			return buffer[position++];
+		}
+
+		uint64_t get()
+		{
+			uint64_t value = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				int byte = next();
+				if (byte == -1)
+				{
+					failed = true;
+					return 0;
+				}
+				value |= (uint64_t)(byte & 0x7F) << shift;
+				if (byte < 0x80) return value;
+			}
+			failed = true;
+			return 0;
+		}
+
+		uint64_t get_address(gc_trace_kind kind)
+		{
+			uint64_t value = get();
+			if (value == 0) return 0;
+			value--;
+			auto delta = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+			last[kind] += (uint64_t)delta;
+			return last[kind];
+		}
+	};
+
+	struct gc_replay_cell
+	{
+		gc_weak_cell*					cell = nullptr;
+		uint64_t						target = 0;
+	};
+
+	struct gc_replay_reference
+	{
+		void**							slot = nullptr;		// nullptr if the object that contains it is forgotten
+		uint64_t						root = 0;			// the recorded address of a gc_ptr outside of objects
+	};
+
+	struct gc_replay_state
+	{
+		gc_replay_reader				reader;
+		bool							threads = false;
+		unordered_map<uint64_t, void*>	objects;			// recorded starts to replayed ones
+		unordered_map<void*, uint64_t>	addresses;			// replayed starts to recorded ones, to follow gc_compact
+		unordered_map<uint64_t, void*>	roots;				// recorded addresses of gc_ptr outside of objects to their storage
+		unordered_map<uint64_t, gc_pointer_map*>			pointer_maps;
+		unordered_map<uint64_t, gc_replay_cell>				cells;
+		unordered_map<uint64_t, gc_heap*>					heaps;
+		vector<thread>					workers;			// replay threads 1 to n, 0 is the calling thread
+		atomic<int>						turn{ 0 };			// the thread that reads the trace, -1 when it is finished
+		gc_replay_stats					stats;
+	};
+
+	gc_replay_state*					gc_replaying = nullptr;
+	vector<unique_ptr<gc_pointer_map>>	gc_replay_pointer_maps;		// like those of types, they outlive every object that uses them
+
+	void gc_trace_relocate_unsafe(void* handle, void* moved)
+	{
+		if (auto state = gc_replaying)
+		{
+			auto it = state->addresses.find(handle);
+			if (it != state->addresses.end())
+			{
+				auto address = it->second;
+				state->addresses.erase(it);
+				state->addresses[moved] = address;
+				state->objects[address] = moved;
+			}
+		}
+		if (gc_tracing)
+		{
+			lock_guard<mutex> guard(gc_trace.lock);
+			if (!gc_trace_begin_unsafe(gc_trace_op::relocate, false)) return;
+			gc_trace_put_address_unsafe(gc_trace_objects, handle);
+			gc_trace_put_address_unsafe(gc_trace_objects, moved);
+			gc_trace_end_unsafe();
+		}
+	}
+
+	void* gc_replay_find(gc_replay_state& state, uint64_t address)
+	{
+		if (!address) return nullptr;
+		auto it = state.objects.find(address);
+		return it == state.objects.end() ? nullptr : it->second;
+	}
+
+	gc_replay_reference gc_replay_get_reference(gc_replay_state& state)
+	{
+		gc_replay_reference reference;
+		if (auto parent = state.reader.get_address(gc_trace_objects))
+		{
+			auto offset = state.reader.get();
+			if (auto object = gc_replay_find(state, parent))
+			{
+				reference.slot = (void**)((char*)object + offset);
+			}
+		}
+		else
+		{
+			reference.root = state.reader.get_address(gc_trace_roots);
+			reference.slot = &state.roots[reference.root];
+		}
+		return reference;
+	}
+
+	void* gc_replay_get_object(gc_replay_state& state)
+	{
+		return gc_replay_find(state, state.reader.get_address(gc_trace_objects));
+	}
+
+	// returns false if the operation is unknown
+	bool gc_replay_record(gc_replay_state& state, gc_trace_op op)
+	{
+		auto& reader = state.reader;
+		switch (op)
+		{
+		case gc_trace_op::alloc:
+			{
+				auto address = reader.get_address(gc_trace_objects);
+				gc_record record;
+				record.length = (size_t)reader.get();
+				auto pointer_map = state.pointer_maps.find(reader.get_address(gc_trace_others));
+				bool relocatable = reader.get() != 0;
+				auto heap = state.heaps.find(reader.get_address(gc_trace_others));
+				if (reader.failed) return false;
+
+				unsafe_functions::gc_alloc(
+					record,
+					pointer_map == state.pointer_maps.end() ? nullptr : pointer_map->second,
+					relocatable,
+					heap == state.heaps.end() ? nullptr : heap->second
+					);
+				state.objects[address] = record.start;
+				state.addresses[record.start] = address;
+			}
+			break;
+		case gc_trace_op::learn:
+			{
+				auto& pointer_map = state.pointer_maps[reader.get_address(gc_trace_others)];
+				if (!pointer_map)
+				{
+					pointer_map = new gc_pointer_map;
+					gc_replay_pointer_maps.emplace_back(pointer_map);
+				}
+				size_t first = (size_t)reader.get();
+				size_t stride = (size_t)reader.get();
+				size_t count = (size_t)reader.get();
+				vector<size_t> offsets;
+				for (size_t i = 0; i < count && !reader.failed; i++)
+				{
+					offsets.push_back((size_t)reader.get());
+				}
+				if (!pointer_map->ready.load(memory_order_relaxed))
+				{
+					pointer_map->offsets = offsets;
+					pointer_map->first = first;
+					pointer_map->stride = stride;
+					pointer_map->ready.store(true, memory_order_release);
+				}
+			}
+			break;
+		case gc_trace_op::attach:
+			{
+				auto handle = gc_replay_get_object(state);
+				auto offset = reader.get();
+				if (handle)
+				{
+					auto e = new((char*)handle + offset)gc_replay_object;
+					unsafe_functions::gc_register(handle, e);
+				}
+			}
+			break;
+		case gc_trace_op::ref_alloc:
+			{
+				auto reference = gc_replay_get_reference(state);
+				auto handle = gc_replay_get_object(state);
+				if (auto slot = reference.slot)
+				{
+					unsafe_functions::gc_store_field(slot, handle);
+					unsafe_functions::gc_ref_alloc(slot, handle);
+				}
+			}
+			break;
+		case gc_trace_op::ref_dealloc:
+			{
+				auto reference = gc_replay_get_reference(state);
+				if (auto slot = reference.slot)
+				{
+					unsafe_functions::gc_ref_dealloc(slot, *slot);
+					unsafe_functions::gc_store_field(slot, nullptr);
+					if (reference.root) state.roots.erase(reference.root);
+				}
+			}
+			break;
+		case gc_trace_op::ref:
+			{
+				auto reference = gc_replay_get_reference(state);
+				auto handle = gc_replay_get_object(state);
+				if (auto slot = reference.slot)
+				{
+					unsafe_functions::gc_ref(slot, *slot, handle);
+					unsafe_functions::gc_store_field(slot, handle);
+				}
+			}
+			break;
+		case gc_trace_op::move_alloc:
+		case gc_trace_op::move:
+		case gc_trace_op::swap:
+			{
+				auto first = gc_replay_get_reference(state).slot;
+				auto second = gc_replay_get_reference(state).slot;
+				if (first && second)
+				{
+					void* handle = *first;
+					void* other_handle = *second;
+					if (op == gc_trace_op::move_alloc)
+					{
+						unsafe_functions::gc_ref_move_alloc(first, second, other_handle);
+						unsafe_functions::gc_store_field(second, nullptr);
+					}
+					else if (op == gc_trace_op::move)
+					{
+						unsafe_functions::gc_ref_move(first, second, handle, other_handle);
+						unsafe_functions::gc_store_field(second, nullptr);
+					}
+					else
+					{
+						unsafe_functions::gc_ref_swap(first, second, handle, other_handle);
+						unsafe_functions::gc_store_field(second, handle);
+					}
+					unsafe_functions::gc_store_field(first, other_handle);
+				}
+				else if (op != gc_trace_op::swap)
+				{
+					// what moves is in a forgotten object, the other side is cleared
+					if (first && op == gc_trace_op::move_alloc)
+					{
+						unsafe_functions::gc_store_field(first, nullptr);
+						unsafe_functions::gc_ref_alloc(first, nullptr);
+					}
+					for (auto slot : { op == gc_trace_op::move ? first : nullptr, second })
+					{
+						if (slot)
+						{
+							unsafe_functions::gc_ref(slot, *slot, nullptr);
+							unsafe_functions::gc_store_field(slot, nullptr);
+						}
+					}
+				}
+			}
+			break;
+		case gc_trace_op::adopt:
+			{
+				auto reference = gc_replay_get_reference(state);
+				auto handle = gc_replay_get_object(state);
+				if (auto slot = reference.slot)
+				{
+					unsafe_functions::gc_store_field(slot, handle);
+					unsafe_functions::gc_ref_adopt(slot, handle);
+				}
+			}
+			break;
+		case gc_trace_op::pin:
+		case gc_trace_op::unpin:
+			if (auto handle = gc_replay_get_object(state))
+			{
+				unsafe_functions::gc_pin(handle, op == gc_trace_op::pin);
+			}
+			break;
+		case gc_trace_op::weak_alloc:
+			{
+				auto address = reader.get_address(gc_trace_objects);
+				auto cell = reader.get_address(gc_trace_others);
+				if (auto handle = gc_replay_find(state, address))
+				{
+					auto& replayed = state.cells[cell];
+					replayed.cell = unsafe_functions::gc_weak_alloc(handle);
+					replayed.target = address;
+				}
+			}
+			break;
+		case gc_trace_op::weak_retain:
+		case gc_trace_op::weak_release:
+			{
+				auto it = state.cells.find(reader.get_address(gc_trace_others));
+				if (it != state.cells.end())
+				{
+					if (op == gc_trace_op::weak_retain)
+					{
+						unsafe_functions::gc_weak_retain(it->second.cell);
+					}
+					else
+					{
+						unsafe_functions::gc_weak_release(it->second.cell);
+					}
+				}
+			}
+			break;
+		case gc_trace_op::weak_lock:
+			{
+				auto reference = gc_replay_get_reference(state);
+				auto it = state.cells.find(reader.get_address(gc_trace_others));
+				bool locked = reader.get() != 0;
+				if (reference.slot && it != state.cells.end())
+				{
+					*reference.slot = unsafe_functions::gc_weak_lock(reference.slot, it->second.cell);
+					if (locked && !*reference.slot && state.objects.erase(it->second.target) > 0)
+					{
+						state.stats.diverged++;
+					}
+				}
+			}
+			break;
+		case gc_trace_op::heap_create:
+			{
+				auto address = reader.get_address(gc_trace_others);
+				state.heaps[address] = new gc_heap((size_t)reader.get());
+			}
+			break;
+		case gc_trace_op::heap_destroy:
+		case gc_trace_op::heap_collect:
+		case gc_trace_op::heap_discard:
+			{
+				auto it = state.heaps.find(reader.get_address(gc_trace_others));
+				if (it == state.heaps.end()) break;
+
+				if (op == gc_trace_op::heap_destroy)
+				{
+					delete it->second;
+					state.heaps.erase(it);
+				}
+				else if (op == gc_trace_op::heap_collect)
+				{
+					it->second->collect();
+				}
+				else
+				{
+					it->second->discard();
+				}
+			}
+			break;
+		case gc_trace_op::force_collect:
+			gc_force_collect();
+			break;
+		case gc_trace_op::collect_step:
+			gc_collect_step((size_t)reader.get());
+			break;
+		case gc_trace_op::compact:
+			gc_compact(reader.get() / 1e6);
+			break;
+		case gc_trace_op::relocate:
+			{
+				auto address = reader.get_address(gc_trace_objects);
+				auto moved = reader.get_address(gc_trace_objects);
+				auto it = state.objects.find(address);
+				if (it != state.objects.end())
+				{
+					auto handle = it->second;
+					state.objects.erase(it);
+					state.objects[moved] = handle;
+					state.addresses[handle] = moved;
+				}
+			}
+			break;
+		case gc_trace_op::collection:
+			for (int i = 0; i < 4; i++)
+			{
+				reader.get();
+			}
+			state.stats.collections++;
+			break;
+		default:
+			return false;
+		}
+		return !reader.failed;
+	}
+
+	// replays records until another thread takes over, returns its index, or -1 when the trace is finished
+	int gc_replay_run(gc_replay_state& state, int index)
+	{
+		while (true)
+		{
+			int op = state.reader.next();
+			if (op == -1) return -1;
+
+			if ((gc_trace_op)op == gc_trace_op::thread)
+			{
+				int thread = (int)state.reader.get();
+				if (state.reader.failed) return -1;
+				state.stats.threads = max(state.stats.threads, (size_t)thread + 1);
+				if (state.threads && thread != index) return thread;
+			}
+			else
+			{
+				if (!gc_replay_record(state, (gc_trace_op)op))
+				{
+					state.reader.failed = true;
+					return -1;
+				}
+				state.stats.events++;
+			}
+		}
+	}
+
+	void gc_replay_thread(gc_replay_state* state, int index)
+	{
+		while (true)
+		{
+			int turn = state->turn.load(memory_order_acquire);
+			if (turn == -1) return;
+			if (turn != index)
+			{
+				this_thread::yield();
+				continue;
+			}
+
+			int next = gc_replay_run(*state, index);
+			while (next > (int)state->workers.size())
+			{
+				state->workers.emplace_back(gc_replay_thread, state, (int)state->workers.size() + 1);
+			}
+			state->turn.store(next, memory_order_release);
+		}
+	}
+
+	bool gc_replay(const char* path, bool threads, gc_replay_stats& stats)
+	{
+		assert(!gc_replaying);
+		FILE* file = fopen(path, "rb");
+		if (!file) return false;
+
+		char magic[sizeof(gc_trace_magic)];
+		if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, gc_trace_magic, sizeof(magic)) != 0)
+		{
+			fclose(file);
+			return false;
+		}
+
+		unique_ptr<gc_replay_state> state(new gc_replay_state);
+		state->reader.file = file;
+		state->threads = threads;
+		gc_replaying = state.get();
+		gc_replay_thread(state.get(), 0);
+		for (auto& worker : state->workers)
+		{
+			worker.join();
+		}
+
+		// what the trace leaves is released, so that gc_stop finds the heap as the recorded run left it
+		for (auto& root : state->roots)
+		{
+			if (root.second)
+			{
+				unsafe_functions::gc_ref_dealloc(&root.second, root.second);
+			}
+		}
+		for (auto& heap : state->heaps)
+		{
+			delete heap.second;
+		}
+		gc_replaying = nullptr;
+		fclose(file);
+		stats = state->stats;
+		return !state->reader.failed;
+	}
+}